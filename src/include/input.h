@@ -0,0 +1,29 @@
+#ifndef INPUT_H
+#define INPUT_H
+
+/*
+ * 输入解码器：一次读取所有可用的输入字节，再逐个解码成按键，
+ * 转义序列不完整时等待更多输入。支持 bracketed paste，
+ * 粘贴的内容整体放入缓冲区，作为一个 PASTE_KEY 返回。
+ */
+
+#define INPUT_READ_SIZE 4096 // 每次 read 的最大字节数
+
+struct AppendBuffer;
+
+typedef struct InputDecoder
+{
+    char *buf;    // 未解码的输入
+    int len;      // 输入长度
+    int cap;      // 已分配大小
+    int pos;      // 下一个要解码的位置
+    int in_paste; // 正在接收粘贴内容
+} InputDecoder;
+
+#define INPUT_INIT {NULL, 0, 0, 0, 0}
+
+void input_feed(InputDecoder *in, const char *s, int len);                          // 添加读取到的字节
+int input_next_key(InputDecoder *in, int flush, struct AppendBuffer *paste);        // 解码下一个按键，输入不完整时返回 -1
+int input_pending(InputDecoder *in);                                                // 是否还有未解码的输入
+
+#endif // !INPUT_H
@@ -0,0 +1,75 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stddef.h>
+
+/*
+ * 恢复日志：把每次修改追加到文件旁边的 ".文件名.mswp" 中，终端异常退出后可以重放。
+ * 日志头记录原文件的大小和修改时间，文件已经变化时日志不再适用。
+ * 使用日志的进程对它加 flock，另一个进程打开同一个文件时不会重放、删除或覆盖它，
+ * 已有的日志不会被截断，不再适用的日志改名保留。
+ * 保存时在替换文件之前追加一条保存标记，记录新文件的日志头和快照对应的日志位置，
+ * 替换文件之后、更新日志之前崩溃也能从标记处重放。保存成功后新的日志写到临时文件中，
+ * 同步后再重命名覆盖，磁盘上总是完整的旧日志或者完整的新日志。
+ * 修改先缓存在内存中，最早的修改超过 JOURNAL_SYNC_MS 或缓存超过 JOURNAL_FLUSH_SIZE 时
+ * 才一次性写入并 fsync，输入时不会等待磁盘。相邻的连续输入合并成一条记录。
+ */
+
+#define JOURNAL_MAGIC "MVIMJNL3"      // 日志文件标识
+#define JOURNAL_SYNC_MS 500           // 修改最多在内存中停留的毫秒数
+#define JOURNAL_FLUSH_SIZE (64 * 1024) // 缓存超过该大小时立即写入
+
+enum JournalKind
+{
+    JOURNAL_INSERT = 'i', // 在 (row, col) 插入文本
+    JOURNAL_APPEND = 'a', // 在文件末尾新增一行后插入文本
+    JOURNAL_DELETE = 'd', // 从 (row, col) 删除 len 个字节
+    JOURNAL_DEL_ROW = 'r', // 删除第 row 行(撤销新增的行)
+    JOURNAL_SAVE = 's'     // 保存标记：文本是保存后文件的日志头，col 是快照之后的修改在日志中的位置
+};
+
+/* 日志中的一条操作 */
+typedef struct JournalOp
+{
+    int kind;
+    int row;
+    long col;
+    size_t len;
+    const char *text; // 插入的文本
+} JournalOp;
+
+typedef struct Journal
+{
+    int fd;             // 日志文件，-1 表示还没有打开
+    int failed;         // 无法创建日志，不再记录
+    int waiting;        // 文件还不存在，保存之后才能创建日志
+    char *path;         // 日志路径
+    char *buf;          // 还没有写入的记录
+    size_t len, cap;
+    size_t last;        // 缓存中最后一条插入记录的位置，用于合并输入
+    int has_last;       // last 有效
+    int end_row;        // 最后一条插入记录的文本终点
+    long end_col;
+    long long first_ms; // 缓存中最早的修改时间
+    long long written;  // 已写入文件的字节数
+} Journal;
+
+#define JOURNAL_INIT {-1, 0, 0, NULL, NULL, 0, 0, 0, 0, 0, 0, 0, 0}
+
+char *journal_path(const char *filename);                                    // 日志路径，需要调用者释放
+int journal_open(Journal *j, const char *filename, int append);            // 打开并锁住日志，append 为 0 时新建，日志已存在时失败
+void journal_insert(Journal *j, int row, long col, const char *s, size_t len, int append_row); // 记录插入
+void journal_delete(Journal *j, int row, long col, size_t len);             // 记录删除
+void journal_del_row(Journal *j, int row);                                  // 记录删除一行
+int journal_timeout(Journal *j);                                            // 距离下一次写入的毫秒数，-1 表示没有
+void journal_tick(Journal *j);                                              // 到时间时写入并同步
+int journal_flush(Journal *j);                                              // 立即写入并同步
+long long journal_offset(Journal *j);                                        // 写入缓存并返回日志的长度，没有日志返回 -1
+void journal_mark_save(Journal *j, const char *saved, long long from);      // 替换文件之前记录保存标记，saved 是写好的临时文件
+void journal_rebase(Journal *j, const char *filename, long long from);      // 文件保存后只保留 from 之后的记录
+void journal_close(Journal *j, int remove);                                 // 关闭日志，remove 为 1 时删除文件
+int journal_check(const char *filename);                                    // 日志可用返回 1，不存在返回 -1，与文件不符返回 0，正被其他进程使用返回 -2
+char *journal_set_aside(const char *filename);                              // 把没有进程使用的日志改名为 ".文件名.mswp.N"，返回新路径，需要调用者释放
+long journal_replay(const char *filename, int (*apply)(const JournalOp *op)); // 重放日志，返回重放的操作数
+
+#endif // !JOURNAL_H
@@ -0,0 +1,32 @@
+#ifndef KEYWORD_H
+#define KEYWORD_H
+
+/*
+ * 关键字表：启动时把以 NULL 结尾的关键字列表编译成完美哈希表，
+ * 查找一个单词只需要计算一次哈希和一次比较，与关键字个数无关。
+ * 以 '|' 结尾的关键字为第二类关键字。
+ */
+
+typedef struct KeywordEntry
+{
+    const char *word; // 关键字(不含 '|')
+    int len;          // 关键字长度，0 表示空槽
+    int kind;         // 1: 第一类关键字 2: 第二类关键字
+} KeywordEntry;
+
+typedef struct KeywordTable
+{
+    KeywordEntry *slots; // 哈希槽，个数为 mask + 1
+    unsigned int mask;   // 槽个数减一(槽个数为 2 的幂)
+    unsigned int seed;   // 使所有关键字落在不同槽的哈希种子
+    int min_len;         // 最短关键字长度
+    int max_len;         // 最长关键字长度
+} KeywordTable;
+
+#define KEYWORD_TABLE_INIT {NULL, 0, 0, 0, 0}
+
+void keyword_table_build(KeywordTable *kt, char **keywords);            // 编译关键字列表
+int keyword_table_lookup(KeywordTable *kt, const char *s, int len);    // 查找单词，返回关键字类型，不是关键字返回 0
+void keyword_table_free(KeywordTable *kt);                              // 释放关键字表
+
+#endif // !KEYWORD_H
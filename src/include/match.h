@@ -0,0 +1,45 @@
+#ifndef MATCH_H
+#define MATCH_H
+
+#include "search.h"
+
+/*
+ * 匹配索引：把整个缓冲区按行分成若干段，由多个线程同时搜索，
+ * 得到按 (行, 列) 排序的所有匹配。之后跳到上一个/下一个匹配只需要二分查找。
+ * 普通字符串保存所有出现的位置(包括相互重叠的)，搜索内容在末尾追加字符时，
+ * 新的匹配一定在原来的匹配中，只需要逐个检查，不用重新搜索整个缓冲区。
+ */
+
+#define MATCH_MAX_THREADS 16         // 最多使用的线程数
+#define MATCH_THREAD_ROWS 65536      // 每个线程至少处理的行数，行数太少时不值得创建线程
+#define MATCH_MAX_STORED (1 << 22)   // 最多保存的匹配个数，超过时只计数
+
+struct RowStore;
+struct EditorRow;
+
+typedef struct Match
+{
+    int row;  // 行号
+    long col; // 在 chars 中的偏移
+} Match;
+
+typedef struct MatchIndex
+{
+    Match *m;          // 按 (row, col) 排序的匹配
+    int n;             // 保存的匹配个数
+    long total;        // 匹配总数，可能大于 n
+    int current;       // 当前匹配的序号，-1 表示没有
+    int active;        // 正在搜索，状态栏显示匹配序号
+    char *query;       // 搜索内容
+    int regex;         // 搜索内容是正则表达式
+    SearchPattern pat; // 编译后的模式，用于计算当前匹配的长度
+} MatchIndex;
+
+#define MATCH_INDEX_INIT {NULL, 0, 0, -1, 0, NULL, 0, {NULL, 0, {0}, NULL}}
+
+int match_index_build(MatchIndex *mi, struct RowStore *rs, const char *query, int regex); // 搜索所有匹配，正则表达式有错误返回 -1
+int match_index_find(MatchIndex *mi, int row, long col, int dir); // dir 为 1 时找 (row, col) 之后第一个，-1 时找之前最后一个，到达边界时回绕
+size_t match_index_length(MatchIndex *mi, struct EditorRow *row, long col); // 从 col 开始的匹配长度
+void match_index_free(MatchIndex *mi);                                     // 释放索引
+
+#endif // !MATCH_H
@@ -4,28 +4,63 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/signalfd.h>
+#endif
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "input.h"
+#include "journal.h"
+#include "keyword.h"
+#include "match.h"
+#include "rowalloc.h"
+#include "rowstore.h"
+#include "screen.h"
+#include "search.h"
+#include "undo.h"
+#include "utf8.h"
 
 #define MVIM_VERSION "0.0.1"
 #define CTRL_KEY(k) ((k) & 0x1f)
 #define MVIM_TAB_STOP 8
 #define MVIM_QUIT_TIMES 3
+#define MVIM_MSG_TIMEOUT 5        // 状态信息显示秒数
+#define MVIM_ESC_TIMEOUT_MS 100   // 转义序列不完整时等待后续字节的毫秒数
+#define MVIM_HL_CHECKPOINT_LINES 128         // 每隔多少行保存一次多行注释状态
+#define MVIM_CACHE_BUDGET (64 * 1024 * 1024) // 渲染缓存默认内存上限，可通过环境变量 MVIM_CACHE_BUDGET 修改
+#define MVIM_UNDO_BUDGET (16 * 1024 * 1024)  // 撤销日志默认内存上限，可通过环境变量 MVIM_UNDO_BUDGET 修改
+#define MVIM_SAVE_IOV 1024                   // 保存时每次 writev 的最大片段数
+#define MVIM_LONG_LINE (256 * 1024)          // 超过这个字节数的行按块索引，只渲染可见的窗口，可通过环境变量 MVIM_LONG_LINE 修改
+#ifndef MVIM_LINE_CHUNK
+#define MVIM_LINE_CHUNK 4096                 // 长行每块的字节数
+#endif
+#define MVIM_ALLOC_STATS "MVIM_ALLOC_STATS"  // 设置这个环境变量时，退出前把行内存分配器的统计追加到它指定的文件
 
 #define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
 
 #define HL_HIGHLIGHT_NUMBERS (1 << 0)
 #define HL_HIGHLIGHT_STRINGS (1 << 1)
 
+#define LEX_IN_COMMENT 1   // 词法状态：在多行注释中
+#define LEX_LINE_COMMENT 2 // 词法状态：在单行注释中，直到行尾
+#define LEX_NOT_SEP 4      // 词法状态：前一个字符不是分隔符(只在生成高亮时记录)
+#define LEX_STRING_SHIFT 8 // 词法状态：所在字符串的引号字符存放的位置
+
 struct EditorSyntax
 {
     char *filetype;
@@ -35,19 +70,72 @@ struct EditorSyntax
     char *multiline_comment_start;
     char *multiline_comment_end;
     int flags;
+    KeywordTable kwtable; // 启动时由 keywords 编译的关键字哈希表
 };
 
 /* data */
 
+/* 行内容 chars 所在的内存 */
+enum RowChars
+{
+    ROW_CHARS_MAPPED = 0, // 直接指向文件映射
+    ROW_CHARS_OWNED,      // 单独从 E.alloc 分配，可以扩大和释放
+    ROW_CHARS_INLINE      // 读入文件时和行结构一起分配，修改前要复制
+};
+
+/* 行内位置的三种坐标 */
+enum RowCoord
+{
+    ROW_CX = 0, // chars 中的字节偏移
+    ROW_RX,     // 屏幕列
+    ROW_RB      // render 中的字节偏移
+};
+
+/* 行内一个字节数和列数不相等的字符(制表符、多字节字符)的起点，at 按 RowCoord 取值 */
+typedef struct RenderStop
+{
+    long at[3];
+} RenderStop;
+
+/* 长行的一块：记录块起点的坐标和词法状态，块的边界都在字符起点上 */
+typedef struct LineChunk
+{
+    long cx;       // 块起点在 chars 中的偏移
+    long rx;       // 块起点的屏幕列
+    long lex_cx;   // 词法分析在块内继续的位置，跨过块起点的记号之后
+    int lex_state; // lex_cx 处的词法状态
+    int has_tab;   // 块内有制表符，块的宽度与起始列有关
+} LineChunk;
+
+/* 长行的块索引和当前渲染的窗口，render、hl 和 stops 只覆盖窗口内的字符 */
+typedef struct LongLine
+{
+    LineChunk *chunks;
+    long n, cap;
+    int lex_in;              // 块的词法状态对应的行首注释状态，-1 表示还没有计算
+    int lex_out;             // 行尾的注释状态
+    unsigned int lex_epoch;  // 计算词法状态时的 E.hl_epoch
+    long win_cx, win_end;    // 窗口在 chars 中的范围，win_end 为 -1 表示还没有选择窗口
+    long win_rx;             // 窗口起点的屏幕列
+} LongLine;
+
 typedef struct EditorRow
 {
-    int idx;
-    int size;     // 行数据字符个数
-    int rsize;    // 渲染行字符个数
-    char *chars;  // 实际行字符串
-    char *render; // 要渲染的行字符串
+    void *node;   // 所属的行存储叶子节点(由 rowstore 维护)
+    long size;    // 行数据字符个数
+    long rsize;   // 渲染行字符个数
+    char *chars;  // 实际行字符串，正在输入的行中间可能有间隙(E.gap)
+    int owned;    // chars 所在的内存(RowChars)
+    char *render; // 要渲染的行字符串，和 hl、stops 分配在同一块内存中
     unsigned char *hl;
-    int hl_open_comment;
+    RenderStop *stops;                     // 特殊字符索引，与 render 一起生成和释放
+    long nstops;                           // 特殊字符个数
+    int multibyte;                         // 含有非 ASCII 字节或只渲染了长行的一部分，render 的偏移与列数不同
+    LongLine *ll;                          // 长行的块索引，普通的行为 NULL
+    int hl_open_comment;                   // 行尾是否处于多行注释中
+    int hl_state_in;                       // 生成 hl 时使用的行首状态
+    unsigned int hl_epoch;                 // 生成 hl 时的 E.hl_epoch，不相等表示高亮已过期
+    struct EditorRow *lru_prev, *lru_next; // 渲染缓存 LRU 链表
 } EditorRow;
 
 enum EditorHighlight
@@ -62,22 +150,78 @@ enum EditorHighlight
     HL_MATCH       // 搜索匹配
 };
 
+/* append buffer，内存跨帧复用，按两倍增长 */
+typedef struct AppendBuffer
+{
+    char *b; // 输出内容
+    int len; // 内容总长度
+    int cap; // 已分配大小
+} AppendBuffer;
+
+#define ABUF_INIT {NULL, 0, 0}
+#define ABUF_MIN_CAP 4096 // 第一次分配的大小
+
+/* 后台保存的子进程通过管道返回的结果 */
+typedef struct SaveResult
+{
+    long long len; // 写入的字节数，-1 表示失败
+    int err;       // 失败时的 errno
+} SaveResult;
+
+/*
+ * 正在输入的行的间隙：chars 中从 at 开始的 len 个字节不属于行内容，
+ * 行内 at 之后的内容在 chars 中要向后偏移 len。同一时间只有一行有间隙。
+ */
+typedef struct RowGap
+{
+    EditorRow *row; // 有间隙的行，NULL 表示没有
+    long at;        // 间隙在行内的位置
+    long len;       // 间隙的字节数
+} RowGap;
+
 typedef struct EditorConfig
 {
-    int cx, cy;                  // 相对整个文本的坐标
-    int rx;                      // 实际渲染的坐标(制表符宽度处理)
+    long cx;                     // 光标在行内的字节偏移
+    int cy;                      // 光标所在行
+    long rx;                     // 实际渲染的坐标(制表符宽度处理)
     int rowoff;                  // 当前已滚动行数
-    int coloff;                  // 当前已滚动列数
+    long coloff;                 // 当前已滚动列数
     int screen_rows;             // 屏幕行数
     int screen_cols;             // 屏幕列数
     int num_rows;                // 要打印内容行数
-    EditorRow *row;              // 行内容数组
+    RowStore rows;               // 行内容存储
+    RowAlloc alloc;              // 行结构、行内容和渲染缓存的内存分配器
+    RowGap gap;                  // 正在输入的行的间隙
     int dirty;                   // 内容状态改变
     char *filename;              // 文件名
+    char *map;                   // 只读文件映射，未修改的行直接指向这里
+    size_t map_len;              // 文件映射长度
     char statusmsg[80];          // 状态栏信息
     time_t statusmsg_time;       // 状态信息时间戳
+    int prompt_active;           // 正在提示框中输入，提示信息不会过期
+    int search_regex;            // 搜索的内容是正则表达式
+    MatchIndex matches;          // 当前搜索的所有匹配
+    int signal_fd;               // 接收 SIGWINCH 的文件描述符
+    UndoLog undo;                // 撤销日志
+    pid_t save_pid;              // 正在后台保存的子进程，-1 表示没有
+    int save_fd;                 // 接收后台保存结果的管道
+    int save_dirty;              // 开始保存时的修改计数
+    Journal journal;             // 恢复日志
+    long long save_journal_off;  // 开始保存时日志已写入的位置
     struct termios orig_termios; // 终端模式
     struct EditorSyntax *syntax;
+    unsigned int hl_epoch;       // 高亮版本号，切换语法时递增使所有行失效
+    unsigned char *hl_cp;        // 每 MVIM_HL_CHECKPOINT_LINES 行的行首注释状态
+    int hl_cp_valid;             // 有效的检查点个数
+    int hl_cp_cap;               // 检查点数组容量
+    EditorRow *lru_head;         // 最近使用的缓存行
+    EditorRow *lru_tail;         // 最久未使用的缓存行
+    size_t cache_bytes;          // render 和 hl 缓存占用字节数
+    size_t cache_budget;         // 缓存内存上限，超过时淘汰最久未使用的行
+    long long_line;              // 按长行处理的最小字节数
+    Screen screen;               // 上一帧发送到终端的内容，用于只输出变化的行
+    InputDecoder input;          // 按键解码器
+    AppendBuffer paste;          // 最近一次粘贴的内容
 } EditorConfig;
 
 enum EditorKey
@@ -91,42 +235,57 @@ enum EditorKey
     HOME_KEY,
     END_KEY,
     PAGE_UP,
-    PAGE_DOWN
+    PAGE_DOWN,
+    PASTE_KEY // 一次完整的粘贴，内容在 E.paste 中
 };
 
-/* append buffer */
-typedef struct AppendBuffer
-{
-    char *b; // 输出内容
-    int len; // 内容总长度
-} AppendBuffer;
-
-#define ABUF_INIT {NULL, 0}
-
 void disable_raw_mode();                                            // 回复终端模式
 void enable_raw_mode();                                             // 设置终端为原始模式
 int editor_read_key();                                              // 读取按键
 int get_cursor_position(int *rows, int *cols);                      // 获取光标位置
 int get_window_size(int *rows, int *cols);                          // 获取屏幕尺寸
-int editor_row_cx_to_rx(EditorRow *row, int cx);                    // 转换实际渲染的列(制表符)
-int editor_row_rx_to_cx(EditorRow *row, int rx);                    // 转换为初始的字符流
+void editor_update_window_size();                                   // 重新获取屏幕尺寸并全部重绘
+void editor_init_events();                                          // 初始化窗口大小改变信号的事件源
+int editor_poll_timeout();                                          // 下一次定时事件的等待毫秒数
+long editor_row_convert(EditorRow *row, long pos, int from, int to); // 在 RowCoord 坐标之间转换
+long editor_row_cx_to_rx(EditorRow *row, long cx);                  // 转换实际渲染的列(制表符)
+long editor_row_rx_to_cx(EditorRow *row, long rx);                  // 转换为初始的字符流
+long editor_row_prev_char(EditorRow *row, long cx);                 // 前一个字符的起点
+long editor_row_next_char(EditorRow *row, long cx);                 // 后一个字符的起点
+long editor_row_char_start(EditorRow *row, long cx);                // cx 所在字符的起点
+EditorRow *editor_row_at(int at);                                   // 获取第 at 行
 void editor_update_row(EditorRow *row);                             // 更新一行内容
+void editor_row_prepare(EditorRow *row);                            // 按需计算并缓存 render 和 hl
 void editor_insert_row(int at, char *s, size_t len);                // 添加一行内容
-void eidtor_row_insert_char(EditorRow *row, int at, int c);         // 插入字符
+void editor_row_own(EditorRow *row);                                // 修改前复制映射中的行内容，并去掉输入间隙
+void editor_row_flatten(EditorRow *row, long end);                  // 读取 chars 前让 [0, end) 连续
+void eidtor_row_insert_char(EditorRow *row, long at, int c);        // 插入字符
 void editor_row_append_string(EditorRow *row, char *s, size_t len); // 附加字符串
-void editor_row_del_char(EditorRow *row, int at);                   // 删除字符
+void editor_row_del_char(EditorRow *row, long at);                  // 删除字符
 void editor_del_char();                                             // 删除字符
 void editor_free_row(EditorRow *row);                               // 释放一行资源
 void editor_del_row(int at);                                        // 删除一行
 void editor_insert_char(int c);                                     // 插入字符
 void editor_insert_newline();                                       // 插入新行
+void editor_insert_text(const char *s, size_t len, int crlf);       // 一次性插入一段文本(粘贴)
+void editor_delete_text(int at, long col, size_t len);              // 一次性删除一段文本
+void editor_undo();                                                 // 撤销
+void editor_redo();                                                 // 重做
 void editor_open(const char *filename);                             // 打开文件
-char *editor_rows_to_string(int *buflen);                           // 将所有内容格式化为字符串
+void editor_close();                                                // 一次性释放当前文件的所有行
+void editor_recover();                                              // 询问是否重放恢复日志
+int editor_open_mmap(int fd);                                       // 通过文件映射打开文件
+long long editor_write_rows(int fd);                                // 把所有行批量写入文件
 void editor_set_status_message(const char *fmt, ...);               // 设置状态栏信息
 void editor_find_callback(char *query, int key);                    // 搜索
-void editor_find();                                                 // 搜索
-void editor_save();                                                 // 保存到文件
+void editor_find(int regex);                                        // 搜索，regex 表示按正则表达式搜索
+void editor_save();                                                 // 在后台保存到文件
+long long editor_write_file(const char *filename);                  // 把所有行写入文件
+void editor_save_finish(long long len, int err, int dirty);         // 报告保存结果
+void editor_save_collect();                                         // 取回后台保存的结果
+void editor_sync_dir(const char *path);                             // 同步文件所在的目录
 void ab_append(AppendBuffer *ab, const char *s, int len);           // 添加打印内容
+void ab_reset(AppendBuffer *ab);                                    // 清空内容，保留内存给下一帧使用
 void ab_free(AppendBuffer *ab);                                     // 释放资源
 void editor_scroll();                                               // 滚屏处理
 void editor_draw_rows(AppendBuffer *ab);                            // 打印一行
@@ -138,8 +297,12 @@ void editor_move_cursor(int key);                                   // 移动光
 void editor_process_keypress();                                     // 处理按键
 void init_editor();                                                 // 初始化
 void editor_update_syntax(EditorRow *row);                          // 更新语法
+long editor_syntax_lex_range(const char *text, long i, long end, long len, unsigned char *hl, int *state); // 分析到 end
+void editor_syntax_invalidate(int at);                              // 使 at 行之后的检查点失效
+int editor_syntax_state_at(int at);                                 // 获取 at 行行首的注释状态
 int editor_syntax_to_color(int hl);                                 // 应用颜色
 void editor_select_syntax_highlight();                              // 选择高亮
+void editor_syntax_compile();                                       // 编译所有语法的关键字表
 int is_separator(int c);                                            // 分隔符判断
 
 #endif
@@ -0,0 +1,23 @@
+#ifndef REGEXP_H
+#define REGEXP_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * 正则表达式：先把表达式编译成 NFA，搜索时按需把用到的 NFA 状态集合构造成 DFA 状态并缓存，
+ * 每个字节只做一次查表，匹配时间与文本长度成线性关系，不会像回溯算法那样退化。
+ *
+ * 支持: 字符 . [abc] [^a-z] \d \w \s \D \W \S ^ $ ( ) | * + ? {m} {m,} {m,n}
+ * 文本可以包含多行，'\n' (以及它前面的 '\r') 是行分隔符，匹配不会跨行，
+ * ^ 和 $ 匹配行首和行尾。同一位置开始的匹配取最长的一个。
+ */
+
+typedef struct Regexp Regexp;
+
+Regexp *regexp_compile(const char *pattern);                                                  // 编译表达式，语法错误返回 NULL
+void regexp_free(Regexp *re);                                                                 // 释放表达式
+ssize_t regexp_search(Regexp *re, const char *text, size_t n, size_t *mlen);                  // 第一个匹配的偏移，没有返回 -1
+ssize_t regexp_search_from(Regexp *re, const char *text, size_t n, size_t from, size_t *mlen); // 从 from 开始查找，之前的内容用于判断行首
+
+#endif // !REGEXP_H
@@ -0,0 +1,64 @@
+#ifndef ROWALLOC_H
+#define ROWALLOC_H
+
+#include <stddef.h>
+
+/*
+ * 行内存分配器：行结构、chars、render/hl 等都从这里分配。
+ * 小块按大小分级，从该级别的 slab 页中切分，释放后进入该级别的空闲链表；
+ * 超过最大级别的块单独分配。批量读入文件时的行从 arena 顺序分配，只计数不回收，
+ * 一个 arena 块中的内容全部释放后整块归还。所有页都按 ROWALLOC_PAGE 对齐，
+ * 页头记录页的类型，释放时只需要指针。页直接向系统映射，关闭文件时整体归还，不必逐行释放。
+ */
+
+#define ROWALLOC_PAGE (256 * 1024) // slab 页和 arena 块的大小，也是所有页的对齐
+#define ROWALLOC_HEAD 64           // 页头占用的字节数
+#define ROWALLOC_MIN 16            // 最小的级别
+#define ROWALLOC_MAX (32 * 1024)   // 最大的级别，更大的块单独分配
+#define ROWALLOC_CLASSES 23        // 级别个数：16、24、32、48 ... 32768
+
+enum RowPageKind
+{
+    ROWPAGE_SLAB = 1, // 切分成同一级别的块
+    ROWPAGE_ARENA,    // 顺序分配
+    ROWPAGE_LARGE     // 单独的一个大块
+};
+
+typedef struct RowPage
+{
+    struct RowPage *prev, *next; // 所有页的链表
+    size_t size;                 // 整页的字节数(包括页头)
+    size_t used;                 // slab: 已分配的块数，arena: 仍在使用的字节数
+    size_t fill;                 // arena: 已经分配出去的字节数
+    int kind;                    // RowPageKind
+    int cls;                     // slab 页的级别
+} RowPage;
+
+typedef struct RowAlloc
+{
+    RowPage *pages;                      // 所有页
+    void *free_list[ROWALLOC_CLASSES];   // 每个级别释放的块
+    RowPage *cur[ROWALLOC_CLASSES];      // 每个级别正在切分的页
+    size_t cur_off[ROWALLOC_CLASSES];    // 正在切分的页中下一个块的偏移
+    RowPage *arena;                      // 正在使用的 arena 块
+    size_t live[ROWALLOC_CLASSES];       // 每个级别已分配的块数
+    size_t reserved;                     // 所有页的字节数
+    size_t large_bytes;                  // 大块的字节数
+    size_t arena_fill;                   // arena 块中已经分配出去的字节数
+    size_t arena_live;                   // 其中仍在使用的字节数
+    size_t npages;                       // 页数(包括大块)
+    size_t allocs, frees;                // 分配和释放次数
+    size_t reallocs, in_place;           // 扩大的次数，其中不需要移动的次数
+} RowAlloc;
+
+#define ROW_ALLOC_INIT {0}
+
+void *row_alloc(RowAlloc *ra, size_t size);                // 分配至少 size 字节
+void *row_realloc(RowAlloc *ra, void *p, size_t size);     // 扩大到至少 size 字节，容量足够时不移动
+void row_free(RowAlloc *ra, void *p);                      // 释放任何方式分配的块
+size_t row_alloc_size(void *p);                            // 块的实际容量
+void *row_arena_alloc(RowAlloc *ra, size_t size);          // 从 arena 顺序分配，用于批量读入
+void row_alloc_reset(RowAlloc *ra);                        // 释放所有页
+int row_alloc_format(RowAlloc *ra, char *buf, size_t len); // 以 key=value 格式输出计数和碎片率
+
+#endif // !ROWALLOC_H
@@ -0,0 +1,48 @@
+#ifndef ROWSTORE_H
+#define ROWSTORE_H
+
+/*
+ * 行存储：带计数的 B+ 树
+ * 叶子节点保存行指针，内部节点保存子树行数，行号不再显式记录，
+ * 通过从根节点向下累加子树行数得到，插入和删除一行都是 O(log n)。
+ */
+
+#define ROWSTORE_FANOUT 64                    // 每个节点最多子节点(行)个数
+#define ROWSTORE_MIN_FILL (ROWSTORE_FANOUT / 4) // 低于该值时与兄弟节点合并或借用
+
+struct EditorRow;
+
+typedef struct RowNode
+{
+    struct RowNode *parent;       // 父节点
+    int leaf;                     // 是否为叶子节点
+    int n;                        // 子节点(行)个数
+    int count;                    // 子树包含的总行数
+    void *slot[ROWSTORE_FANOUT]; // 叶子节点: EditorRow *，内部节点: RowNode *
+} RowNode;
+
+typedef struct RowStore
+{
+    RowNode *root;
+} RowStore;
+
+/* 顺序遍历迭代器，相邻行的访问均摊 O(1) */
+typedef struct RowIter
+{
+    RowNode *leaf;
+    int pos;
+} RowIter;
+
+#define ROWSTORE_INIT {NULL}
+
+int rowstore_count(RowStore *rs);                                    // 总行数
+struct EditorRow *rowstore_get(RowStore *rs, int at);               // 获取第 at 行
+void rowstore_insert(RowStore *rs, int at, struct EditorRow *row);  // 在 at 处插入一行
+struct EditorRow *rowstore_remove(RowStore *rs, int at);            // 移除第 at 行并返回
+int rowstore_index_of(struct EditorRow *row);                       // 计算行所在行号
+void rowstore_free(RowStore *rs, void (*free_row)(struct EditorRow *)); // 释放所有节点
+struct EditorRow *rowstore_seek(RowStore *rs, int at, RowIter *it); // 定位迭代器到第 at 行
+struct EditorRow *rowstore_next(RowIter *it);                       // 迭代器移动到下一行
+struct EditorRow *rowstore_prev(RowIter *it);                       // 迭代器移动到上一行
+
+#endif // !ROWSTORE_H
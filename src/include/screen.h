@@ -0,0 +1,31 @@
+#ifndef SCREEN_H
+#define SCREEN_H
+
+/*
+ * 屏幕影子缓冲：保存上一帧实际发送到终端的每一行内容，
+ * 刷新时只发送有变化的行，并且跳过新旧两行相同的开头部分。
+ */
+
+struct AppendBuffer;
+
+typedef struct ScreenLine
+{
+    char *b; // 上一帧发送的内容(包含颜色转义序列)
+    int len; // 内容长度，-1 表示终端上的内容未知
+    int cap; // 已分配大小
+} ScreenLine;
+
+typedef struct Screen
+{
+    ScreenLine *lines; // 每个屏幕行一项(包括状态栏和信息栏)
+    int rows;          // 屏幕行数
+    int cols;          // 屏幕列数
+} Screen;
+
+#define SCREEN_INIT {NULL, 0, 0}
+
+void screen_resize(Screen *scr, int rows, int cols); // 调整大小，所有行都需要重绘
+void screen_invalidate(Screen *scr);                 // 终端内容未知，下一帧全部重绘
+void screen_put_line(Screen *scr, struct AppendBuffer *out, int y, const char *s, int len); // 输出一行的变化部分
+
+#endif // !SCREEN_H
@@ -0,0 +1,30 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * 子串搜索引擎：在一段连续的内存中查找模式串。
+ * 查找时先用 SSE2 同时比较模式串首尾两个字节，一次过滤 16 个位置，
+ * 候选位置再逐字节确认；不支持 SSE2 时使用 Horspool 算法。
+ * 模式也可以是正则表达式，此时交给 regexp.c 中的 DFA 匹配。
+ */
+
+struct Regexp;
+
+typedef struct SearchPattern
+{
+    const char *needle;  // 模式串(不复制，使用期间必须有效)
+    size_t len;          // 模式串长度
+    size_t skip[256];    // Horspool 算法中每个字节的跳跃距离
+    struct Regexp *re;   // 正则表达式，NULL 表示普通字符串
+} SearchPattern;
+
+void search_compile(SearchPattern *pat, const char *needle, size_t len);                             // 预处理模式串
+int search_compile_regex(SearchPattern *pat, const char *pattern);                                   // 编译正则表达式，语法错误返回 -1
+void search_free(SearchPattern *pat);                                                                // 释放模式
+ssize_t search_forward(const SearchPattern *pat, const char *text, size_t n, size_t *mlen);           // 第一个匹配的偏移，*mlen 为匹配长度，没有返回 -1
+ssize_t search_next(const SearchPattern *pat, const char *text, size_t n, size_t from, size_t *mlen); // 从 from 开始查找，之前的内容用于判断行首
+
+#endif // !SEARCH_H
@@ -0,0 +1,71 @@
+#ifndef UNDO_H
+#define UNDO_H
+
+#include <stddef.h>
+
+/*
+ * 撤销日志：只追加的插入/删除记录，记录头和文本一起顺序存放在分块的内存池中。
+ * 连续输入或删除的相邻字符合并到同一条记录，撤销时整段文本一次性插入或删除。
+ * 内存池超过上限时丢弃最旧的块，新的修改会截断可以重做的记录。
+ */
+
+#define UNDO_CHUNK_SIZE (64 * 1024) // 每个内存块的默认大小，更长的记录单独分配
+
+enum UndoKind
+{
+    UNDO_INSERT = 1, // 插入了 text
+    UNDO_DELETE      // 删除了 text
+};
+
+typedef struct UndoRecord
+{
+    int kind;           // UNDO_INSERT / UNDO_DELETE
+    int row;            // 文本起点
+    long col;
+    int end_row;        // 插入记录的文本终点，用于合并后续输入
+    long end_col;
+    int reversed;       // 退格删除时文本按逆序追加
+    int append_row;     // 插入前在文件末尾新增了一行
+    size_t len;         // 文本长度，换行符算一个字节
+    char text[];        // 文本
+} UndoRecord;
+
+typedef struct UndoChunk
+{
+    struct UndoChunk *prev, *next;
+    size_t used; // 已使用字节数
+    size_t cap;  // 容量
+    char data[];
+} UndoChunk;
+
+/* 记录索引，撤销和重做时按序号访问 */
+typedef struct UndoEntry
+{
+    UndoRecord *rec;
+    UndoChunk *chunk; // 记录所在的块
+} UndoEntry;
+
+typedef struct UndoLog
+{
+    UndoChunk *first, *last; // 内存块链表
+    UndoEntry *entries;      // 从旧到新的记录
+    int n;                   // 记录个数
+    int cap;                 // entries 容量
+    int cur;                 // 已生效的记录个数，之后的记录可以重做
+    int open;                // 最后一条记录还可以合并
+    int applying;            // 正在撤销或重做，修改不再记录
+    size_t bytes;            // 内存块总大小
+    size_t budget;           // 内存上限
+} UndoLog;
+
+#define UNDO_LOG_INIT {NULL, NULL, NULL, 0, 0, 0, 0, 0, 0, 0}
+
+void undo_insert(UndoLog *u, int row, long col, const char *s, size_t len, int append_row); // 记录插入，与上一次输入相邻时合并
+void undo_delete(UndoLog *u, int row, long col, char c);  // 记录删除一个字符，连续退格或删除时合并
+void undo_seal(UndoLog *u);                               // 结束合并，之后的修改另起一条记录
+UndoRecord *undo_step_back(UndoLog *u);                   // 取出要撤销的记录，没有时返回 NULL
+UndoRecord *undo_step_forward(UndoLog *u);                // 取出要重做的记录，没有时返回 NULL
+char *undo_text(UndoRecord *rec);                         // 按正序返回记录的文本，需要调用者释放
+void undo_free(UndoLog *u);                               // 释放所有记录
+
+#endif // !UNDO_H
@@ -0,0 +1,17 @@
+#ifndef UTF8_H
+#define UTF8_H
+
+/*
+ * UTF-8 解码和字符显示宽度。宽度由启动时生成的两级查找表给出：
+ * 第一级按码点的高位找到一个 256 项的块，第二级直接取宽度，内容相同的块只保存一份。
+ * 东亚宽字符和全角字符占两列，组合字符占零列，其余占一列。
+ */
+
+#define UTF8_BLOCK_BITS 8                       // 每个块包含的码点数的位数
+#define UTF8_MAX_CODEPOINT 0x10ffff             // 最大码点
+
+int utf8_decode(const char *s, long len, int *cp); // 解码 s 处的一个字符，返回字节数，无效的字节返回 1 且 *cp 为 -1
+int utf8_width(int cp);                            // 码点的显示宽度(0、1 或 2)
+void utf8_init();                                  // 生成宽度查找表
+
+#endif // !UTF8_H
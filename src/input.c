@@ -0,0 +1,190 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "./include/input.h"
+#include "./include/mvim.h"
+#include "./include/utils.h"
+
+#define PASTE_END "\x1b[201~"
+#define PASTE_END_LEN 6
+
+void input_feed(InputDecoder *in, const char *s, int len)
+{
+    /* 丢弃已解码的部分 */
+    if (in->pos > 0)
+    {
+        memmove(in->buf, &in->buf[in->pos], in->len - in->pos);
+        in->len -= in->pos;
+        in->pos = 0;
+    }
+
+    if (in->len + len > in->cap)
+    {
+        int cap = in->cap ? in->cap : INPUT_READ_SIZE;
+        while (cap < in->len + len)
+            cap *= 2;
+        char *buf = realloc(in->buf, cap);
+        if (buf == NULL)
+            die("realloc");
+        in->buf = buf;
+        in->cap = cap;
+    }
+    memcpy(&in->buf[in->len], s, len);
+    in->len += len;
+}
+
+int input_pending(InputDecoder *in)
+{
+    return in->pos < in->len;
+}
+
+/* 收集粘贴内容直到结束标志，结束标志可能被分在两次读取中 */
+static int input_paste(InputDecoder *in, AppendBuffer *paste)
+{
+    char *p = &in->buf[in->pos];
+    int avail = in->len - in->pos;
+
+    char *end = memmem(p, avail, PASTE_END, PASTE_END_LEN);
+    if (end)
+    {
+        ab_append(paste, p, end - p);
+        in->pos += end - p + PASTE_END_LEN;
+        in->in_paste = 0;
+        return PASTE_KEY;
+    }
+
+    /* 末尾可能是结束标志的开头，留到下次 */
+    int keep = 0;
+    for (int k = PASTE_END_LEN - 1; k > 0; k--)
+    {
+        if (avail >= k && !memcmp(&p[avail - k], PASTE_END, k))
+        {
+            keep = k;
+            break;
+        }
+    }
+    ab_append(paste, p, avail - keep);
+    in->pos += avail - keep;
+    return -1;
+}
+
+/* 解码 "\x1b[" 开头的控制序列，params 为参数部分，final 为结束字符 */
+static int input_csi_key(const char *params, int plen, char final)
+{
+    if (final == '~')
+    {
+        if (plen == 1)
+        {
+            switch (params[0])
+            {
+            case '1':
+                return HOME_KEY; // "\x1b[1~" 表示键盘上的 HOME 按键
+            case '3':
+                return DEL_KEY;
+            case '4':
+                return END_KEY;
+            case '5':
+                return PAGE_UP;
+            case '6':
+                return PAGE_DOWN;
+            case '7':
+                return HOME_KEY;
+            case '8':
+                return END_KEY;
+            }
+        }
+        return '\x1b';
+    }
+
+    /* 带修饰键参数的方向键(如 "\x1b[1;5A")按普通方向键处理 */
+    switch (final)
+    {
+    case 'A':
+        return ARROW_UP; // "\x1b[A" 表示向上箭头
+    case 'B':
+        return ARROW_DOWN;
+    case 'C':
+        return ARROW_RIGHT;
+    case 'D':
+        return ARROW_LEFT;
+    case 'H':
+        return HOME_KEY;
+    case 'F':
+        return END_KEY;
+    }
+    return '\x1b';
+}
+
+int input_next_key(InputDecoder *in, int flush, AppendBuffer *paste)
+{
+    while (1)
+    {
+        if (in->in_paste)
+            return input_paste(in, paste);
+
+        if (in->pos >= in->len)
+            return -1;
+
+        char *p = &in->buf[in->pos];
+        int avail = in->len - in->pos;
+
+        /* 处理一般字符 */
+        if (p[0] != '\x1b')
+        {
+            in->pos++;
+            return (unsigned char)p[0];
+        }
+
+        /* 转义序列不完整：超时后按 escape 处理并丢弃剩余部分，否则等待更多输入 */
+        int need = 2;
+        int j = 0;
+        if (avail >= 2 && p[1] == '[')
+        {
+            /* 参数字节 0x30-0x3f，中间字节 0x20-0x2f，结束字节 0x40-0x7e */
+            j = 2;
+            while (j < avail && p[j] >= 0x20 && p[j] <= 0x3f)
+                j++;
+            need = j + 1;
+        }
+        else if (avail >= 2 && p[1] == 'O')
+        {
+            need = 3;
+        }
+        if (avail < need)
+        {
+            if (!flush)
+                return -1;
+            in->pos = in->len;
+            return '\x1b';
+        }
+
+        in->pos += need;
+        if (p[1] == '[')
+        {
+            /* bracketed paste 开始标志 "\x1b[200~" */
+            if (p[j] == '~' && j == 5 && !memcmp(&p[2], "200", 3))
+            {
+                in->in_paste = 1;
+                ab_reset(paste);
+                continue;
+            }
+            if (p[j] == '~' && j == 5 && !memcmp(&p[2], "201", 3))
+                continue; // 多余的结束标志
+            return input_csi_key(&p[2], j - 2, p[j]);
+        }
+        else if (p[1] == 'O')
+        {
+            switch (p[2])
+            {
+            case 'H':
+                return HOME_KEY; // "\x1bOH" 在一些旧终端中也表示 HOME 按键
+            case 'F':
+                return END_KEY;
+            }
+        }
+        /* escape 字符 */
+        return '\x1b';
+    }
+}
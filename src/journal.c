@@ -0,0 +1,590 @@
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "./include/journal.h"
+#include "./include/utils.h"
+
+#define JOURNAL_REC_HEAD 21 // 类型 1 字节，行 4 字节，列和长度各 8 字节
+
+/* 日志头：原文件的大小和修改时间 */
+typedef struct JournalHeader
+{
+    char magic[8];
+    long long size;
+    long long mtime_sec;
+    long long mtime_nsec;
+} JournalHeader;
+
+static long long journal_now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+char *journal_path(const char *filename)
+{
+    /* 与文件在同一目录，文件名前加 "." 后加 ".mswp" */
+    const char *slash = strrchr(filename, '/');
+    size_t dir_len = slash ? (size_t)(slash - filename + 1) : 0;
+    size_t len = strlen(filename);
+    char *path = malloc(len + sizeof(".") + sizeof(".mswp"));
+    if (path == NULL)
+        die("malloc");
+    memcpy(path, filename, dir_len);
+    path[dir_len] = '.';
+    memcpy(&path[dir_len + 1], &filename[dir_len], len - dir_len);
+    memcpy(&path[len + 1], ".mswp", sizeof(".mswp"));
+    return path;
+}
+
+static int journal_header(const char *filename, JournalHeader *h)
+{
+    struct stat st;
+    if (stat(filename, &st) == -1)
+        return -1;
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, JOURNAL_MAGIC, sizeof(h->magic));
+    h->size = st.st_size;
+    h->mtime_sec = st.st_mtim.tv_sec;
+    h->mtime_nsec = st.st_mtim.tv_nsec;
+    return 0;
+}
+
+static int journal_write_all(int fd, const char *s, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, s, len);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        s += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* 在 p 处写入一条记录的头部 */
+static void journal_encode(char *p, int kind, int row, long long col, size_t len)
+{
+    int32_t r = row;
+    int64_t c = col;
+    uint64_t n = len;
+    p[0] = kind;
+    memcpy(&p[1], &r, 4);
+    memcpy(&p[5], &c, 8);
+    memcpy(&p[13], &n, 8);
+}
+
+/* data 中 pos 处记录的长度，记录不完整(写入时崩溃)时返回 0 */
+static size_t journal_record_len(const char *data, size_t size, size_t pos)
+{
+    if (pos + JOURNAL_REC_HEAD > size)
+        return 0;
+    int kind = data[pos];
+    if (kind != JOURNAL_INSERT && kind != JOURNAL_APPEND && kind != JOURNAL_SAVE)
+        return JOURNAL_REC_HEAD;
+    uint64_t n;
+    memcpy(&n, &data[pos + 13], 8);
+    if (n > size - pos - JOURNAL_REC_HEAD)
+        return 0;
+    return JOURNAL_REC_HEAD + n;
+}
+
+/* 读入整个日志，*size 为读到的字节数 */
+static char *journal_read_all(int fd, size_t *size)
+{
+    struct stat st;
+    *size = 0;
+    if (fstat(fd, &st) == -1)
+        return NULL;
+    char *data = malloc(st.st_size ? st.st_size : 1);
+    if (data == NULL)
+        die("malloc");
+    ssize_t got = pread(fd, data, st.st_size, 0);
+    *size = got > 0 ? got : 0;
+    return data;
+}
+
+/* 对日志加锁表示它属于当前进程，锁随进程退出(包括崩溃)自动释放，被其他进程锁住时返回 -1 */
+static int journal_lock(int fd)
+{
+    return flock(fd, LOCK_EX | LOCK_NB);
+}
+
+/* 日志是否属于正在运行的另一个进程 */
+static int journal_busy(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return 0;
+    int busy = journal_lock(fd) == -1;
+    close(fd);
+    return busy;
+}
+
+/* 把 path 改名为 path.N 保留下来，不覆盖已有的文件，返回新的路径 */
+static char *journal_move_aside(const char *path)
+{
+    size_t len = strlen(path) + 16;
+    char *aside = malloc(len);
+    if (aside == NULL)
+        die("malloc");
+    for (int i = 1; i < 1000; i++)
+    {
+        snprintf(aside, len, "%s.%d", path, i);
+        if (link(path, aside) == 0)
+        {
+            unlink(path);
+            return aside;
+        }
+        if (errno != EEXIST)
+            break;
+    }
+    free(aside);
+    return NULL;
+}
+
+/* 日志旁边以进程号命名的临时文件，需要调用者释放 */
+static char *journal_temp_path(const char *path)
+{
+    size_t len = strlen(path) + 32;
+    char *tmp = malloc(len);
+    if (tmp == NULL)
+        die("malloc");
+    snprintf(tmp, len, "%s.%ld", path, (long)getpid());
+    return tmp;
+}
+
+/* 新建临时文件，加锁后写入日志头和之后的记录，返回文件描述符 */
+static int journal_create(const char *tmp, const JournalHeader *h, const char *tail, size_t tail_len)
+{
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_APPEND, 0600);
+    if (fd == -1)
+        return -1;
+    if (journal_lock(fd) == -1 || journal_write_all(fd, (const char *)h, sizeof(*h)) == -1 ||
+        journal_write_all(fd, tail, tail_len) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* 无法使用日志，不再记录。日志路径可能属于其他进程，只关闭自己的文件 */
+static int journal_fail(Journal *j)
+{
+    if (j->fd != -1)
+        close(j->fd);
+    j->fd = -1;
+    j->failed = 1;
+    return -1;
+}
+
+int journal_open(Journal *j, const char *filename, int append)
+{
+    if (j->fd != -1)
+        return 0;
+    if (j->failed || j->waiting)
+        return -1;
+
+    free(j->path);
+    j->path = journal_path(filename);
+
+    if (append)
+    {
+        /* 接管崩溃留下的日志，已经被其他进程接管时放弃 */
+        j->fd = open(j->path, O_WRONLY | O_CLOEXEC | O_APPEND);
+        if (j->fd == -1 || journal_lock(j->fd) == -1)
+            return journal_fail(j);
+        j->written = lseek(j->fd, 0, SEEK_END);
+        return 0;
+    }
+
+    /* 新文件或者正在后台另存为，文件还不存在，不是错误 */
+    JournalHeader h;
+    if (journal_header(filename, &h) == -1)
+    {
+        if (errno != ENOENT)
+            return journal_fail(j);
+        j->waiting = 1;
+        return -1;
+    }
+
+    /*
+     * 先在以进程号命名的临时文件中加锁并写入日志头，再链接成日志，已经存在的日志不会被覆盖。
+     * 已有的日志没有进程使用时(打开文件之后才崩溃的另一个进程留下的)改名保留，再重新链接
+     */
+    char *tmp = journal_temp_path(j->path);
+    int ok = 0;
+    j->fd = journal_create(tmp, &h, NULL, 0);
+    if (j->fd != -1)
+    {
+        ok = link(tmp, j->path) == 0;
+        if (!ok && errno == EEXIST && !journal_busy(j->path))
+        {
+            char *aside = journal_move_aside(j->path);
+            ok = aside && link(tmp, j->path) == 0;
+            free(aside);
+        }
+    }
+    unlink(tmp);
+    free(tmp);
+    if (!ok)
+        return journal_fail(j);
+    j->written = sizeof(h);
+    return 0;
+}
+
+/* 在缓存末尾追加一条记录 */
+static void journal_append(Journal *j, int kind, int row, long col, const char *s, size_t len)
+{
+    if (j->len + JOURNAL_REC_HEAD + len > j->cap)
+    {
+        size_t cap = j->cap ? j->cap : 4096;
+        while (cap < j->len + JOURNAL_REC_HEAD + len)
+            cap *= 2;
+        j->buf = realloc(j->buf, cap);
+        if (j->buf == NULL)
+            die("realloc");
+        j->cap = cap;
+    }
+
+    if (j->len == 0)
+        j->first_ms = journal_now_ms();
+
+    char *p = &j->buf[j->len];
+    journal_encode(p, kind, row, col, len);
+    if (s)
+        memcpy(&p[JOURNAL_REC_HEAD], s, len);
+    j->len += JOURNAL_REC_HEAD + (s ? len : 0);
+
+    if (j->len >= JOURNAL_FLUSH_SIZE)
+        journal_flush(j);
+}
+
+void journal_insert(Journal *j, int row, long col, const char *s, size_t len, int append_row)
+{
+    if (j->fd == -1)
+        return;
+
+    /* 紧接在缓存中上一条插入之后的输入直接追加到该记录 */
+    if (j->has_last && !append_row && j->end_row == row && j->end_col == col)
+    {
+        if (j->len + len > j->cap)
+        {
+            size_t cap = j->cap;
+            while (cap < j->len + len)
+                cap *= 2;
+            j->buf = realloc(j->buf, cap);
+            if (j->buf == NULL)
+                die("realloc");
+            j->cap = cap;
+        }
+        uint64_t n;
+        memcpy(&n, &j->buf[j->last + 13], 8);
+        n += len;
+        memcpy(&j->buf[j->last + 13], &n, 8);
+        memcpy(&j->buf[j->len], s, len);
+        j->len += len;
+        if (j->len >= JOURNAL_FLUSH_SIZE)
+            journal_flush(j); // 之后的输入从新的记录开始
+    }
+    else
+    {
+        journal_append(j, append_row ? JOURNAL_APPEND : JOURNAL_INSERT, row, col, s, len);
+        if (j->len == 0)
+            return; // 已经写入文件，不能再合并
+        j->last = j->len - JOURNAL_REC_HEAD - len;
+        j->has_last = 1;
+        j->end_row = row;
+        j->end_col = col;
+    }
+
+    /* 更新文本终点 */
+    for (size_t i = 0; i < len; i++)
+    {
+        if (s[i] == '\n')
+        {
+            j->end_row++;
+            j->end_col = 0;
+        }
+        else
+        {
+            j->end_col++;
+        }
+    }
+}
+
+void journal_delete(Journal *j, int row, long col, size_t len)
+{
+    if (j->fd == -1)
+        return;
+    journal_append(j, JOURNAL_DELETE, row, col, NULL, len);
+    j->has_last = 0;
+}
+
+void journal_del_row(Journal *j, int row)
+{
+    if (j->fd == -1)
+        return;
+    journal_append(j, JOURNAL_DEL_ROW, row, 0, NULL, 0);
+    j->has_last = 0;
+}
+
+int journal_timeout(Journal *j)
+{
+    if (j->len == 0)
+        return -1;
+    long long left = j->first_ms + JOURNAL_SYNC_MS - journal_now_ms();
+    return left > 0 ? (int)left : 0;
+}
+
+void journal_tick(Journal *j)
+{
+    if (j->len > 0 && journal_timeout(j) == 0)
+        journal_flush(j);
+}
+
+int journal_flush(Journal *j)
+{
+    j->has_last = 0;
+    if (j->fd == -1 || j->len == 0)
+        return 0;
+
+    int r = journal_write_all(j->fd, j->buf, j->len);
+    if (r == 0)
+    {
+        j->written += j->len;
+        r = fdatasync(j->fd);
+    }
+    j->len = 0;
+    return r;
+}
+
+long long journal_offset(Journal *j)
+{
+    journal_flush(j);
+    return j->fd == -1 ? -1 : lseek(j->fd, 0, SEEK_END);
+}
+
+void journal_mark_save(Journal *j, const char *saved, long long from)
+{
+    JournalHeader h;
+    if (j->fd == -1 || journal_header(saved, &h) == -1)
+        return;
+    if (from < (long long)sizeof(h))
+        from = sizeof(h);
+
+    /* 直接写入文件，后台保存时父进程的缓存不在这里；重命名不改变修改时间，日志头与替换后的文件一致 */
+    char rec[JOURNAL_REC_HEAD + sizeof(h)];
+    journal_encode(rec, JOURNAL_SAVE, 0, from, sizeof(h));
+    memcpy(&rec[JOURNAL_REC_HEAD], &h, sizeof(h));
+    if (journal_write_all(j->fd, rec, sizeof(rec)) == 0)
+        fdatasync(j->fd);
+}
+
+void journal_rebase(Journal *j, const char *filename, long long from)
+{
+    if (j->fd == -1)
+        return;
+    journal_flush(j);
+    if (from < (long long)sizeof(JournalHeader))
+        from = sizeof(JournalHeader); // 开始保存时还没有日志，其中的修改都在保存之后
+
+    /* 读出保存之后的修改，去掉保存标记 */
+    int rfd = open(j->path, O_RDONLY | O_CLOEXEC);
+    size_t size = 0;
+    char *data = rfd == -1 ? NULL : journal_read_all(rfd, &size);
+    if (rfd != -1)
+        close(rfd);
+    if ((size_t)from > size)
+        from = size;
+    size_t tail_len = 0;
+    size_t rec;
+    for (size_t pos = from; data && (rec = journal_record_len(data, size, pos)) != 0; pos += rec)
+    {
+        if (data[pos] != JOURNAL_SAVE)
+        {
+            memmove(&data[from + tail_len], &data[pos], rec);
+            tail_len += rec;
+        }
+    }
+
+    /* 新的日志写到临时文件并同步，再重命名覆盖旧日志 */
+    JournalHeader h;
+    char *tmp = journal_temp_path(j->path);
+    int fd = data && journal_header(filename, &h) == 0 ? journal_create(tmp, &h, &data[from], tail_len) : -1;
+    if (fd != -1 && (fdatasync(fd) == -1 || rename(tmp, j->path) == -1))
+    {
+        close(fd);
+        fd = -1;
+    }
+    if (fd == -1)
+    {
+        /* 继续使用旧日志，其中的保存标记仍然对应新的文件 */
+        unlink(tmp);
+        j->written = lseek(j->fd, 0, SEEK_END);
+    }
+    else
+    {
+        close(j->fd);
+        j->fd = fd;
+        j->written = sizeof(h) + tail_len;
+    }
+    free(tmp);
+    free(data);
+}
+
+void journal_close(Journal *j, int remove)
+{
+    if (j->fd != -1)
+    {
+        if (!remove)
+            journal_flush(j);
+        close(j->fd);
+        j->fd = -1;
+        if (remove)
+            unlink(j->path); // 只删除属于自己的日志
+    }
+    j->len = 0;
+    j->has_last = 0;
+    j->written = 0;
+}
+
+/*
+ * 打开日志并检查日志头是否与文件一致，*start 为需要重放的记录的位置。
+ * lock 为 1 时同时检查日志是否正被其他进程使用
+ */
+static int journal_open_check(const char *filename, int *fd, int lock, size_t *start)
+{
+    char *path = journal_path(filename);
+    *fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (*fd == -1)
+    {
+        free(path);
+        return -1;
+    }
+    if (lock && journal_lock(*fd) == -1)
+    {
+        free(path);
+        return -2;
+    }
+
+    JournalHeader h, expect;
+    struct stat st;
+    if (pread(*fd, &h, sizeof(h), 0) != sizeof(h) || journal_header(filename, &expect) == -1)
+    {
+        free(path);
+        return 0;
+    }
+    *start = sizeof(h);
+
+    if (memcmp(&h, &expect, sizeof(h)) != 0)
+    {
+        /* 替换文件之后、更新日志之前崩溃：从与文件一致的最后一个保存标记记录的位置重放 */
+        size_t size;
+        char *data = journal_read_all(*fd, &size);
+        int found = 0;
+        size_t rec;
+        for (size_t pos = sizeof(h); (rec = journal_record_len(data, size, pos)) != 0; pos += rec)
+        {
+            if (data[pos] == JOURNAL_SAVE && rec == JOURNAL_REC_HEAD + sizeof(h) &&
+                !memcmp(&data[pos + JOURNAL_REC_HEAD], &expect, sizeof(expect)))
+            {
+                int64_t c;
+                memcpy(&c, &data[pos + 5], 8);
+                *start = c;
+                found = 1;
+            }
+        }
+        free(data);
+        free(path);
+        return found;
+    }
+
+    /* 保存之后没有任何修改，日志已经没有用(加了锁才能确定不是其他进程刚创建的) */
+    int r = 1;
+    if (lock && (fstat(*fd, &st) == -1 || st.st_size == sizeof(h)))
+    {
+        unlink(path);
+        r = -1;
+    }
+    free(path);
+    return r;
+}
+
+int journal_check(const char *filename)
+{
+    int fd;
+    size_t start;
+    int r = journal_open_check(filename, &fd, 1, &start);
+    if (fd != -1)
+        close(fd);
+    return r;
+}
+
+char *journal_set_aside(const char *filename)
+{
+    char *path = journal_path(filename);
+    char *aside = journal_busy(path) ? NULL : journal_move_aside(path);
+    free(path);
+    return aside;
+}
+
+long journal_replay(const char *filename, int (*apply)(const JournalOp *op))
+{
+    int fd;
+    size_t start;
+    if (journal_open_check(filename, &fd, 0, &start) != 1)
+    {
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+
+    /* 整个日志一次读入，最后一条记录不完整时(写入时崩溃)忽略 */
+    size_t size;
+    char *data = journal_read_all(fd, &size);
+    close(fd);
+
+    long count = 0;
+    size_t rec;
+    for (size_t pos = start; (rec = journal_record_len(data, size, pos)) != 0; pos += rec)
+    {
+        if (data[pos] == JOURNAL_SAVE)
+            continue;
+        int32_t r;
+        int64_t c;
+        uint64_t n;
+        memcpy(&r, &data[pos + 1], 4);
+        memcpy(&c, &data[pos + 5], 8);
+        memcpy(&n, &data[pos + 13], 8);
+
+        JournalOp op;
+        op.kind = data[pos];
+        op.row = r;
+        op.col = c;
+        op.len = n;
+        op.text = op.kind == JOURNAL_INSERT || op.kind == JOURNAL_APPEND ? &data[pos + JOURNAL_REC_HEAD] : NULL;
+        if (apply(&op) == -1)
+            break;
+        count++;
+    }
+    free(data);
+    return count;
+}
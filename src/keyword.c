@@ -0,0 +1,111 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "./include/keyword.h"
+#include "./include/utils.h"
+
+/* FNV-1a 哈希，seed 用于寻找无冲突的完美哈希 */
+static unsigned int keyword_hash(const char *s, int len, unsigned int seed)
+{
+    unsigned int h = 2166136261u ^ seed;
+    for (int i = 0; i < len; i++)
+    {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* 尝试用 seed 把所有关键字放入表中，有冲突返回 -1 */
+static int keyword_table_fill(KeywordTable *kt, char **keywords, unsigned int seed)
+{
+    memset(kt->slots, 0, sizeof(KeywordEntry) * (kt->mask + 1));
+    for (int j = 0; keywords[j]; j++)
+    {
+        int len = strlen(keywords[j]);
+        int kind = 1;
+        if (len > 0 && keywords[j][len - 1] == '|')
+        {
+            len--;
+            kind = 2;
+        }
+        if (len == 0)
+            continue;
+
+        KeywordEntry *e = &kt->slots[keyword_hash(keywords[j], len, seed) & kt->mask];
+        if (e->len)
+        {
+            /* 重复的关键字保留第一个 */
+            if (e->len == len && !memcmp(e->word, keywords[j], len))
+                continue;
+            return -1;
+        }
+        e->word = keywords[j];
+        e->len = len;
+        e->kind = kind;
+    }
+    kt->seed = seed;
+    return 0;
+}
+
+void keyword_table_build(KeywordTable *kt, char **keywords)
+{
+    int n = 0;
+    kt->min_len = 0;
+    kt->max_len = 0;
+    for (int j = 0; keywords && keywords[j]; j++)
+    {
+        int len = strlen(keywords[j]);
+        if (len > 0 && keywords[j][len - 1] == '|')
+            len--;
+        if (len == 0)
+            continue;
+        if (kt->min_len == 0 || len < kt->min_len)
+            kt->min_len = len;
+        if (len > kt->max_len)
+            kt->max_len = len;
+        n++;
+    }
+
+    /* 槽个数至少为关键字个数的两倍，找不到无冲突的种子时加倍 */
+    unsigned int size = 8;
+    while (size < (unsigned int)n * 2)
+        size <<= 1;
+
+    kt->slots = NULL;
+    while (1)
+    {
+        kt->slots = realloc(kt->slots, sizeof(KeywordEntry) * size);
+        if (kt->slots == NULL)
+            die("realloc");
+        kt->mask = size - 1;
+        if (n == 0)
+        {
+            memset(kt->slots, 0, sizeof(KeywordEntry) * size);
+            return;
+        }
+        for (unsigned int seed = 0; seed < 256; seed++)
+        {
+            if (keyword_table_fill(kt, keywords, seed) == 0)
+                return;
+        }
+        size <<= 1;
+    }
+}
+
+int keyword_table_lookup(KeywordTable *kt, const char *s, int len)
+{
+    if (kt->slots == NULL || len < kt->min_len || len > kt->max_len)
+        return 0;
+
+    KeywordEntry *e = &kt->slots[keyword_hash(s, len, kt->seed) & kt->mask];
+    if (e->len == len && !memcmp(e->word, s, len))
+        return e->kind;
+    return 0;
+}
+
+void keyword_table_free(KeywordTable *kt)
+{
+    free(kt->slots);
+    kt->slots = NULL;
+}
@@ -0,0 +1,282 @@
+#define _DEFAULT_SOURCE
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "./include/match.h"
+#include "./include/mvim.h"
+#include "./include/utils.h"
+
+/* 每个线程负责一段连续的行 */
+typedef struct MatchWorker
+{
+    RowStore *rs;
+    const char *query;
+    int regex;
+    int from, to; // 负责的行范围 [from, to)
+    Match *m;     // 找到的匹配
+    int n, cap;
+    long total;   // 匹配个数(包括超过上限没有保存的)
+    pthread_t tid;
+} MatchWorker;
+
+/* 映射中的行 row 是否紧跟在 end 之后，中间只隔着换行符 */
+static int match_row_follows(const char *end, EditorRow *row)
+{
+    if (row->owned || row->chars < end || row->chars - end > 2)
+        return 0;
+    for (const char *p = end; p < row->chars; p++)
+        if (*p != '\n' && *p != '\r')
+            return 0;
+    return 1;
+}
+
+static void match_worker_add(MatchWorker *w, int row, long col)
+{
+    w->total++;
+    if (w->n == MATCH_MAX_STORED)
+        return;
+    if (w->n == w->cap)
+    {
+        w->cap = w->cap ? w->cap * 2 : 256;
+        if (w->cap > MATCH_MAX_STORED)
+            w->cap = MATCH_MAX_STORED;
+        w->m = realloc(w->m, sizeof(Match) * w->cap);
+        if (w->m == NULL)
+            die("realloc");
+    }
+    w->m[w->n].row = row;
+    w->m[w->n].col = col;
+    w->n++;
+}
+
+/*
+ * 搜索 [from, to) 中的所有匹配。映射中连续未修改的行合并成一段整体搜索，
+ * 找到的位置再顺序对应到所在的行。正则表达式的 DFA 缓存不能共享，每个线程单独编译。
+ * 每次都从上一个匹配的末尾继续，search_next 只扫描到下一个匹配附近，
+ * 很长的一行中有很多匹配时总时间仍和文本长度成线性关系。
+ */
+static void *match_worker_run(void *arg)
+{
+    MatchWorker *w = arg;
+    SearchPattern pat;
+    if (w->regex)
+        search_compile_regex(&pat, w->query);
+    else
+        search_compile(&pat, w->query, strlen(w->query));
+
+    RowIter it;
+    EditorRow *row = rowstore_seek(w->rs, w->from, &it);
+    int at = w->from;
+    while (at < w->to)
+    {
+        RowIter cur = it;
+        EditorRow *r = row;
+        int r_at = at;
+        const char *base = row->chars;
+        const char *end = row->chars + row->size;
+        int mapped = !row->owned;
+
+        while (++at < w->to)
+        {
+            row = rowstore_next(&it);
+            if (!mapped || !match_row_follows(end, row))
+                break;
+            end = row->chars + row->size;
+        }
+
+        size_t n = end - base;
+        size_t from = 0;
+        size_t mlen;
+        ssize_t off;
+        while (from <= n && (off = search_next(&pat, base, n, from, &mlen)) != -1)
+        {
+            const char *p = base + off;
+            while (p > r->chars + r->size)
+            {
+                r = rowstore_next(&cur);
+                r_at++;
+            }
+            match_worker_add(w, r_at, p - r->chars);
+
+            /* 普通字符串从下一个字节继续，找出重叠的匹配；空匹配同样向后移动一个字节，越过行尾时从下一行开始 */
+            from = off + (mlen && w->regex ? mlen : 1);
+            size_t row_end = r->chars + r->size - base;
+            if (from > row_end)
+            {
+                const char *nl = memchr(base + row_end, '\n', n - row_end);
+                if (nl == NULL)
+                    break;
+                from = nl - base + 1;
+            }
+        }
+    }
+
+    search_free(&pat);
+    return NULL;
+}
+
+/* 只保留原来的匹配中仍然匹配 query 的，按行号顺序访问，相邻的行不用重新定位 */
+static void match_index_narrow(MatchIndex *mi, RowStore *rs, const char *query, size_t qlen)
+{
+    RowIter it;
+    EditorRow *row = NULL;
+    int at = -1;
+    int n = 0;
+    for (int i = 0; i < mi->n; i++)
+    {
+        Match m = mi->m[i];
+        if (m.row != at)
+        {
+            row = at != -1 && m.row == at + 1 ? rowstore_next(&it) : rowstore_seek(rs, m.row, &it);
+            at = m.row;
+        }
+        if (m.col + qlen <= (size_t)row->size && !memcmp(&row->chars[m.col], query, qlen))
+            mi->m[n++] = m;
+    }
+    mi->n = n;
+    mi->total = n;
+}
+
+int match_index_build(MatchIndex *mi, RowStore *rs, const char *query, int regex)
+{
+    size_t qlen = strlen(query);
+    char *copy = malloc(qlen + 1);
+    if (copy == NULL)
+        die("malloc");
+    memcpy(copy, query, qlen + 1);
+
+    /* 在上一次的普通字符串末尾追加了字符，并且上一次的匹配都保存下来了 */
+    if (!regex && mi->query && !mi->regex && mi->query[0] && mi->n == mi->total &&
+        !strncmp(query, mi->query, strlen(mi->query)))
+    {
+        search_free(&mi->pat);
+        free(mi->query);
+        mi->query = copy;
+        search_compile(&mi->pat, mi->query, qlen);
+        match_index_narrow(mi, rs, mi->query, qlen);
+        mi->current = -1;
+        return 0;
+    }
+
+    match_index_free(mi);
+    mi->query = copy;
+    mi->regex = regex;
+
+    if (!regex)
+        search_compile(&mi->pat, mi->query, qlen);
+    else if (search_compile_regex(&mi->pat, mi->query) == -1)
+        return -1;
+    if (qlen == 0)
+        return 0;
+
+    /* 行数较多时分给多个线程 */
+    int num_rows = rowstore_count(rs);
+    long threads = num_rows / MATCH_THREAD_ROWS + 1;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > cpus)
+        threads = cpus;
+    if (threads > MATCH_MAX_THREADS)
+        threads = MATCH_MAX_THREADS;
+    if (threads < 1)
+        threads = 1;
+
+    MatchWorker workers[MATCH_MAX_THREADS];
+    for (int k = 0; k < threads; k++)
+    {
+        MatchWorker *w = &workers[k];
+        memset(w, 0, sizeof(*w));
+        w->rs = rs;
+        w->query = mi->query;
+        w->regex = regex;
+        w->from = (long long)num_rows * k / threads;
+        w->to = (long long)num_rows * (k + 1) / threads;
+    }
+
+    /* 第一段在当前线程中搜索，创建线程失败时也在当前线程中完成 */
+    int started[MATCH_MAX_THREADS] = {0};
+    for (int k = 1; k < threads; k++)
+        started[k] = pthread_create(&workers[k].tid, NULL, match_worker_run, &workers[k]) == 0;
+    match_worker_run(&workers[0]);
+    for (int k = 1; k < threads; k++)
+    {
+        if (started[k])
+            pthread_join(workers[k].tid, NULL);
+        else
+            match_worker_run(&workers[k]);
+    }
+
+    /* 按顺序合并各段的结果 */
+    long stored = 0;
+    for (int k = 0; k < threads; k++)
+    {
+        mi->total += workers[k].total;
+        stored += workers[k].n;
+    }
+    if (stored > MATCH_MAX_STORED)
+        stored = MATCH_MAX_STORED;
+    mi->m = malloc(sizeof(Match) * (stored ? stored : 1));
+    if (mi->m == NULL)
+        die("malloc");
+    for (int k = 0; k < threads; k++)
+    {
+        int count = workers[k].n;
+        if (count > stored - mi->n)
+            count = stored - mi->n;
+        memcpy(&mi->m[mi->n], workers[k].m, sizeof(Match) * count);
+        mi->n += count;
+        free(workers[k].m);
+    }
+    return 0;
+}
+
+/* 第一个不小于 (row, col) 的匹配的序号 */
+static int match_lower_bound(MatchIndex *mi, int row, long col)
+{
+    int lo = 0, hi = mi->n;
+    while (lo < hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+        Match *m = &mi->m[mid];
+        if (m->row < row || (m->row == row && m->col < col))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+int match_index_find(MatchIndex *mi, int row, long col, int dir)
+{
+    if (mi->n == 0)
+        return -1;
+    if (dir > 0)
+    {
+        int i = match_lower_bound(mi, row, col + 1);
+        return i == mi->n ? 0 : i;
+    }
+    int i = match_lower_bound(mi, row, col) - 1;
+    return i < 0 ? mi->n - 1 : i;
+}
+
+size_t match_index_length(MatchIndex *mi, EditorRow *row, long col)
+{
+    size_t mlen = 0;
+    if (search_next(&mi->pat, row->chars, row->size, col, &mlen) != col)
+        return 0;
+    return mlen;
+}
+
+void match_index_free(MatchIndex *mi)
+{
+    free(mi->m);
+    free(mi->query);
+    search_free(&mi->pat);
+    mi->m = NULL;
+    mi->query = NULL;
+    mi->n = 0;
+    mi->total = 0;
+    mi->current = -1;
+}
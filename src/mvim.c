@@ -14,12 +14,14 @@ char *C_HL_keywords[] = {"switch", "if",      "while",   "for",    "break",
                          "long|",  "double|", "float|",  "char|",  "unsigned|", "signed|",  "void|",  NULL};
 
 struct EditorSyntax HLDB[] = {
-    {"c", C_HL_extensions, C_HL_keywords, "//", "/*", "*/", HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS},
+    {"c", C_HL_extensions, C_HL_keywords, "//", "/*", "*/", HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+     KEYWORD_TABLE_INIT},
 };
 
 /* 回复终端输入模式 */
 void disable_raw_mode()
 {
+    write(STDOUT_FILENO, "\x1b[?2004l", 8); // 关闭 bracketed paste
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1)
     {
         die("tcsetattr");
@@ -44,104 +46,170 @@ void enable_raw_mode()
     raw.c_lflag &= ~(ECHO | IEXTEN | ICANON |
                      ISIG); // 关闭回显 | 关闭扩展处理功能 | 关闭行缓冲(不需要输入会车) | 关闭信号，如 SIGINT
     raw.c_cc[VMIN] = 0;     // 指定 read() 调用读取最少字符数，0 表示立即返回
-    raw.c_cc[VTIME] = 1;    // 指定 read() 调用超时时间，单位为十分之一秒(1/10 second)
+    raw.c_cc[VTIME] = 0;    // 不在 read() 中等待，由 poll() 等待输入
 
     // 应用属性，TCSAFLUSH 表示丢弃所用缓冲区的数据
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
     {
         die("tcsetattr");
     }
+
+    write(STDOUT_FILENO, "\x1b[?2004h", 8); // 开启 bracketed paste，粘贴内容以 "\x1b[200~" 和 "\x1b[201~" 包围
 }
 
-/* 读取按键 */
-int editor_read_key()
+#ifndef __linux__
+static int winch_pipe[2] = {-1, -1};
+
+/* 没有 signalfd 时通过管道把信号转换为可读事件 */
+static void editor_sigwinch_handler(int sig)
+{
+    (void)sig;
+    int saved_errno = errno;
+    write(winch_pipe[1], "", 1);
+    errno = saved_errno;
+}
+#endif
+
+/* 把 SIGWINCH(Linux 上还有 SIGHUP 和 SIGTERM)转换为可以和标准输入一起 poll 的文件描述符 */
+void editor_init_events()
 {
-    int nread;
-    char c;
+#ifdef __linux__
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGWINCH);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGTERM);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1)
+        die("sigprocmask");
+    E.signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (E.signal_fd == -1)
+        die("signalfd");
+#else
+    if (pipe(winch_pipe) == -1)
+        die("pipe");
+    fcntl(winch_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(winch_pipe[1], F_SETFL, O_NONBLOCK);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = editor_sigwinch_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    if (sigaction(SIGWINCH, &sa, NULL) == -1)
+        die("sigaction");
+    E.signal_fd = winch_pipe[0];
+#endif
+}
 
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1)
+/* 距离下一次需要重绘的毫秒数，-1 表示没有定时事件，空闲时不占用 CPU */
+int editor_poll_timeout()
+{
+    int timeout = -1;
+    if (input_pending(&E.input) && !E.input.in_paste)
     {
-        if (nread == -1 && errno != EAGAIN) // EAGAIN 表示系统资源暂时无法获取等原因，可以稍后继续尝试
-            die("read");
+        timeout = MVIM_ESC_TIMEOUT_MS;
     }
+    /* 状态信息到期时需要重绘清除 */
+    else if (E.statusmsg[0] && !E.prompt_active && time(NULL) - E.statusmsg_time < MVIM_MSG_TIMEOUT)
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        long long expire_ms = (long long)(E.statusmsg_time + MVIM_MSG_TIMEOUT) * 1000;
+        long long now_ms = (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+        timeout = expire_ms > now_ms ? (int)(expire_ms - now_ms) + 1 : 0;
+    }
+
+    /* 恢复日志中缓存的修改需要按时写入 */
+    int journal = journal_timeout(&E.journal);
+    if (journal != -1 && (timeout == -1 || journal < timeout))
+        timeout = journal;
+    return timeout;
+}
+
+/* 读取按键：等待标准输入、窗口大小改变和定时事件，解码出完整的按键后返回 */
+int editor_read_key()
+{
+    int key;
+    char buf[INPUT_READ_SIZE];
 
-    /* 处理控制流字符 */
-    if (c == '\x1b')
+    while ((key = input_next_key(&E.input, 0, &E.paste)) == -1)
     {
-        char seq[3];
-        if (read(STDIN_FILENO, &seq[0], 1) != 1) // 读取下一个字符
-            return '\x1b';
-        if (read(STDIN_FILENO, &seq[1], 1) != 1) // 读取后面第二个字符
-            return '\x1b';
+        /* 描述符为 -1 的项会被 poll 忽略 */
+        struct pollfd fds[3];
+        fds[0].fd = STDIN_FILENO;
+        fds[0].events = POLLIN;
+        fds[1].fd = E.signal_fd;
+        fds[1].events = POLLIN;
+        fds[2].fd = E.save_fd;
+        fds[2].events = POLLIN;
+
+        int n = poll(fds, 3, editor_poll_timeout());
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            die("poll");
+        }
+        journal_tick(&E.journal);
 
-        /* 处理控制流字符标志'[' */
-        if (seq[0] == '[')
+        /* 窗口大小改变，立即重新布局 */
+        if (E.signal_fd != -1 && (fds[1].revents & POLLIN))
         {
-            /* '[' 字符后的字符为数字 */
-            if (seq[1] >= '0' && seq[1] <= '9')
+#ifdef __linux__
+            /* 终端关闭或被终止时先把修改写入恢复日志 */
+            struct signalfd_siginfo si;
+            while (read(E.signal_fd, &si, sizeof(si)) == sizeof(si))
             {
-                if (read(STDIN_FILENO, &seq[2], 1) != 1) // 读取下一个字符
-                    return '\x1b';
-                if (seq[2] == '~')
+                if (si.ssi_signo == SIGHUP || si.ssi_signo == SIGTERM)
                 {
-                    switch (seq[1])
-                    {
-                    case '1':
-                        return HOME_KEY; // "\x1b[1~" 表示键盘上的 HOME 按键
-                    case '3':
-                        return DEL_KEY;
-                    case '4':
-                        return END_KEY;
-                    case '5':
-                        return PAGE_UP;
-                    case '6':
-                        return PAGE_DOWN;
-                    case '7':
-                        return HOME_KEY;
-                    case '8':
-                        return END_KEY;
-                    }
+                    journal_close(&E.journal, 0);
+                    exit(1);
                 }
             }
-            /* '[' 后字符的字符不是数字 */
-            else
+#else
+            char sigbuf[128];
+            while (read(E.signal_fd, sigbuf, sizeof(sigbuf)) > 0)
+                ;
+#endif
+            editor_update_window_size();
+            editor_refresh_screen();
+        }
+
+        /* 后台保存结束 */
+        if (E.save_fd != -1 && (fds[2].revents & (POLLIN | POLLHUP | POLLERR)))
+        {
+            editor_save_collect();
+            editor_refresh_screen();
+        }
+
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR))
+        {
+            int nread = read(STDIN_FILENO, buf, sizeof(buf));
+            if (nread == -1 && errno != EAGAIN) // EAGAIN 表示系统资源暂时无法获取等原因，可以稍后继续尝试
+                die("read");
+            if (nread == 0 && (fds[0].revents & POLLHUP))
             {
-                switch (seq[1])
-                {
-                case 'A':
-                    return ARROW_UP; // "\x1b[A" 表示向上箭头
-                case 'B':
-                    return ARROW_DOWN;
-                case 'C':
-                    return ARROW_RIGHT;
-                case 'D':
-                    return ARROW_LEFT;
-                case 'H':
-                    return HOME_KEY;
-                case 'F':
-                    return END_KEY;
-                }
+                journal_close(&E.journal, 0); // 终端已关闭，保留恢复日志
+                exit(1);
             }
+            if (nread > 0)
+                input_feed(&E.input, buf, nread);
         }
-        /* \x1b 后的字符不是 '[' */
-        else if (seq[0] == 'O')
+        else if (n == 0)
         {
-            switch (seq[1])
+            /* 超时：不完整的转义序列按 escape 处理，或者状态信息到期需要重绘 */
+            if (input_pending(&E.input) && !E.input.in_paste)
             {
-            case 'H':
-                return HOME_KEY; // "\x1bOH" 在一些旧终端中也表示 HOME 按键
-            case 'F':
-                return END_KEY;
+                key = input_next_key(&E.input, 1, &E.paste);
+                if (key != -1)
+                    return key;
+            }
+            else
+            {
+                editor_refresh_screen();
             }
         }
-        /* escape 字符 */
-        return '\x1b';
-    }
-    /* 处理一般字符 */
-    else
-    {
-        return c;
     }
+    return key;
 }
 
 /* 获取光标位置 */
@@ -200,67 +268,810 @@ int get_window_size(int *rows, int *cols)
     }
 }
 
-int editor_row_cx_to_rx(EditorRow *row, int cx)
+/* 获取第 at 行，超出范围返回 NULL */
+EditorRow *editor_row_at(int at)
+{
+    return rowstore_get(&E.rows, at);
+}
+
+/* 将行加入 LRU 链表头部 */
+static void editor_cache_touch(EditorRow *row)
+{
+    if (E.lru_head == row)
+        return;
+
+    /* 已在链表中时先摘下 */
+    if (row->lru_prev || row->lru_next || E.lru_tail == row)
+    {
+        if (row->lru_prev)
+            row->lru_prev->lru_next = row->lru_next;
+        if (row->lru_next)
+            row->lru_next->lru_prev = row->lru_prev;
+        if (E.lru_tail == row)
+            E.lru_tail = row->lru_prev;
+    }
+    else
+    {
+        E.cache_bytes += row_alloc_size(row->render); // render、hl 和 stops 在同一块中
+    }
+
+    row->lru_prev = NULL;
+    row->lru_next = E.lru_head;
+    if (E.lru_head)
+        E.lru_head->lru_prev = row;
+    E.lru_head = row;
+    if (E.lru_tail == NULL)
+        E.lru_tail = row;
+}
+
+/* 释放行的渲染缓存，hl_open_comment 状态保留 */
+static void editor_cache_drop(EditorRow *row)
+{
+    if (row->lru_prev || row->lru_next || E.lru_head == row)
+    {
+        if (row->lru_prev)
+            row->lru_prev->lru_next = row->lru_next;
+        else
+            E.lru_head = row->lru_next;
+        if (row->lru_next)
+            row->lru_next->lru_prev = row->lru_prev;
+        else
+            E.lru_tail = row->lru_prev;
+        row->lru_prev = row->lru_next = NULL;
+        E.cache_bytes -= row_alloc_size(row->render);
+    }
+    row_free(&E.alloc, row->render);
+    row->render = NULL;
+    row->hl = NULL;
+    row->stops = NULL;
+    row->nstops = 0;
+}
+
+/* 超出内存上限时从最久未使用的行开始淘汰，keep 不会被淘汰 */
+static void editor_cache_trim(EditorRow *keep)
+{
+    while (E.cache_bytes > E.cache_budget && E.lru_tail && E.lru_tail != keep)
+        editor_cache_drop(E.lru_tail);
+}
+
+/*
+ * 让行内 [0, end) 的内容连续：输入间隙移到 end 之后，读取 chars 之前调用。
+ * end 到达行尾时去掉间隙，间隙的空间留作之后扩展的余量。
+ */
+void editor_row_flatten(EditorRow *row, long end)
+{
+    if (row != E.gap.row)
+        return;
+    if (end >= row->size)
+    {
+        memmove(&row->chars[E.gap.at], &row->chars[E.gap.at + E.gap.len], row->size - E.gap.at);
+        row->chars[row->size] = '\0';
+        E.gap.row = NULL;
+        return;
+    }
+    if (end > E.gap.at)
+    {
+        memmove(&row->chars[E.gap.at], &row->chars[E.gap.at + E.gap.len], end - E.gap.at);
+        E.gap.at = end;
+    }
+}
+
+/* 去掉正在输入的行的间隙，整个缓冲区都可以直接读取 */
+static void editor_gap_close()
+{
+    if (E.gap.row)
+        editor_row_flatten(E.gap.row, E.gap.row->size);
+}
+
+/*
+ * chars 中 cx 处的字符在三种坐标中分别占的长度，rx 为它的起始列(制表符的宽度与位置有关)。
+ * 无效的 UTF-8 字节和 C1 控制字符显示为一个 '?'。
+ */
+static void editor_char_span(EditorRow *row, long cx, long rx, long span[3])
 {
-    int rx = 0; // 实际渲染的列数
-    int j;
-    for (j = 0; j < cx; j++)
+    unsigned char ch = row->chars[cx];
+    if (ch == '\t')
     {
-        /* 处理 tab 字符 */
-        if (row->chars[j] == '\t')
-            rx += (MVIM_TAB_STOP - 1) - (rx % MVIM_TAB_STOP);
-        rx++;
+        span[ROW_CX] = 1;
+        span[ROW_RX] = span[ROW_RB] = MVIM_TAB_STOP - rx % MVIM_TAB_STOP;
+        return;
+    }
+    if (ch < 0x80)
+    {
+        span[ROW_CX] = span[ROW_RX] = span[ROW_RB] = 1;
+        return;
+    }
+
+    int cp;
+    span[ROW_CX] = utf8_decode(&row->chars[cx], row->size - cx, &cp);
+    if (cp < 0xa0)
+    {
+        span[ROW_RX] = span[ROW_RB] = 1;
+        return;
     }
+    span[ROW_RX] = utf8_width(cp);
+    span[ROW_RB] = span[ROW_CX];
+}
+
+#define LEX_LOOKBACK 16  // 比任何注释分界符都长
+#define GAP_LOOKAHEAD 64 // 读取到 end 时多留的连续字节，超过一个 UTF-8 字符和词法分析向后查看的长度
+
+/* 行是否按长行处理 */
+static int editor_row_is_long(EditorRow *row)
+{
+    return row->size >= E.long_line;
+}
+
+/* 释放长行的块索引 */
+static void editor_long_line_free(EditorRow *row)
+{
+    if (row->ll == NULL)
+        return;
+    row_free(&E.alloc, row->ll->chunks);
+    row_free(&E.alloc, row->ll);
+    row->ll = NULL;
+}
+
+/*
+ * 从 *cx 处(起始列 rx)逐个字符扫描到 end，返回停下处的列，同时记录其中是否有制表符。
+ * 最后一个字符可能越过 end，*cx 更新为实际停下的位置。
+ */
+static long editor_long_line_scan(EditorRow *row, long *cx, long end, long rx, int *has_tab)
+{
+    long span[3];
+    long at = *cx;
+    int tab = 0;
+    editor_row_flatten(row, end + GAP_LOOKAHEAD);
+    while (at < end)
+    {
+        if (row->chars[at] == '\t')
+            tab = 1;
+        editor_char_span(row, at, rx, span);
+        at += span[ROW_CX];
+        rx += span[ROW_RX];
+    }
+    *cx = at;
+    *has_tab = tab;
     return rx;
 }
 
-int editor_row_rx_to_cx(EditorRow *row, int rx)
+/* 在块数组的 at 处腾出一项 */
+static LineChunk *editor_long_line_insert_chunk(LongLine *ll, long at)
 {
-    int cur_rx = 0;
-    int cx;
-    for (cx = 0; cx < row->size; cx++)
+    if (ll->n == ll->cap)
     {
-        if (row->chars[cx] == '\t')
-            cur_rx += (MVIM_TAB_STOP - 1) - (cur_rx % MVIM_TAB_STOP);
-        cur_rx++;
-        if (cur_rx > rx)
-            return cx;
+        ll->chunks = row_realloc(&E.alloc, ll->chunks, sizeof(LineChunk) * (ll->cap ? ll->cap * 2 : 64));
+        ll->cap = row_alloc_size(ll->chunks) / sizeof(LineChunk);
     }
-    return cx;
+    memmove(&ll->chunks[at + 1], &ll->chunks[at], sizeof(LineChunk) * (ll->n - at));
+    ll->n++;
+    return &ll->chunks[at];
 }
 
-void editor_update_row(EditorRow *row)
+static void editor_long_line_remove_chunk(LongLine *ll, long at)
 {
-    int tabs = 0;
-    int j;
-    /* 计算 tab 个数 */
-    for (j = 0; j < row->size; j++)
-        if (row->chars[j] == '\t')
-            tabs++;
-    free(row->render);
-    row->render = malloc(row->size + tabs * (MVIM_TAB_STOP) + 1);
+    memmove(&ll->chunks[at], &ll->chunks[at + 1], sizeof(LineChunk) * (ll->n - at - 1));
+    ll->n--;
+}
+
+/* 长行的块索引，第一次需要时扫描整行建立 */
+static LongLine *editor_long_line(EditorRow *row)
+{
+    if (row->ll)
+        return row->ll;
+
+    LongLine *ll = row_alloc(&E.alloc, sizeof(LongLine));
+    memset(ll, 0, sizeof(LongLine));
+    ll->lex_in = -1;
+    ll->win_end = -1;
+    row->ll = ll;
+    editor_row_flatten(row, row->size);
+
+    /* 至少有一块，之后的查找不需要判断空数组 */
+    long cx = 0, rx = 0;
+    do
+    {
+        long end = editor_row_char_start(row, cx + MVIM_LINE_CHUNK);
+        if (end > row->size)
+            end = row->size;
+        LineChunk *c = editor_long_line_insert_chunk(ll, ll->n);
+        c->cx = c->lex_cx = cx;
+        c->rx = rx;
+        c->lex_state = 0;
+        rx = editor_long_line_scan(row, &cx, end, rx, &c->has_tab);
+    } while (cx < row->size);
+    return ll;
+}
+
+/* 坐标 from 不超过 pos 的最后一块 */
+static long editor_long_line_find(LongLine *ll, long pos, int from)
+{
+    long lo = 0, hi = ll->n;
+    while (hi - lo > 1)
+    {
+        long mid = lo + (hi - lo) / 2;
+        if ((from == ROW_CX ? ll->chunks[mid].cx : ll->chunks[mid].rx) <= pos)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* 以 state 为行首状态计算每块起点的词法状态和行尾的注释状态 */
+static void editor_long_line_lex(EditorRow *row, int state)
+{
+    LongLine *ll = editor_long_line(row);
+    if (ll->lex_in == state && ll->lex_epoch == E.hl_epoch)
+        return;
+
+    ll->lex_in = state;
+    ll->lex_epoch = E.hl_epoch;
+    long i = 0;
+    for (long k = 0; k < ll->n; k++)
+    {
+        editor_row_flatten(row, ll->chunks[k].cx + GAP_LOOKAHEAD);
+        i = editor_syntax_lex_range(row->chars, i, ll->chunks[k].cx, row->size, NULL, &state);
+        ll->chunks[k].lex_cx = i;
+        ll->chunks[k].lex_state = state;
+    }
+    editor_row_flatten(row, row->size);
+    editor_syntax_lex_range(row->chars, i, row->size, row->size, NULL, &state);
+    ll->lex_out = state & LEX_IN_COMMENT;
+}
 
-    int idx = 0;
-    for (j = 0; j < row->size; j++)
+/* 行首状态为 state 时长行行尾的注释状态 */
+static int editor_long_line_state_out(EditorRow *row, int state)
+{
+    editor_long_line_lex(row, state);
+    return row->ll->lex_out;
+}
+
+/* 长行的 cx 和 rx 互相转换：找到 pos 所在的块，从块起点逐个字符扫描，规则与 editor_row_convert 相同 */
+static long editor_long_line_convert(EditorRow *row, long pos, int from, int to)
+{
+    LongLine *ll = editor_long_line(row);
+    long k = editor_long_line_find(ll, pos, from);
+    LineChunk *c = &ll->chunks[k];
+    long at[3] = {c->cx, c->rx, 0};
+    editor_row_flatten(row, (k + 1 < ll->n ? ll->chunks[k + 1].cx : row->size) + GAP_LOOKAHEAD);
+    long span[3];
+    while (at[ROW_CX] < row->size && at[from] <= pos)
     {
-        /* 处理制表符 */
-        if (row->chars[j] == '\t')
+        editor_char_span(row, at[ROW_CX], at[ROW_RX], span);
+        if (at[from] + span[from] > pos)
+            return span[from] == span[to] ? at[to] + (pos - at[from]) : at[to];
+        at[ROW_CX] += span[ROW_CX];
+        at[ROW_RX] += span[ROW_RX];
+    }
+    long r = at[to] + (pos - at[from]);
+    return to == ROW_CX && r > row->size ? row->size : r;
+}
+
+/* 让长行的窗口覆盖 [from_rx, to_rx) 列，两边各多留一块，窗口需要移动时丢弃原来的渲染缓存 */
+static void editor_long_line_window(EditorRow *row, long from_rx, long to_rx)
+{
+    LongLine *ll = editor_long_line(row);
+    long k0 = editor_long_line_find(ll, from_rx, ROW_RX);
+    long k1 = editor_long_line_find(ll, to_rx, ROW_RX) + 2;
+    if (k0 > 0)
+        k0--;
+    long start = ll->chunks[k0].cx;
+    long end = k1 < ll->n ? ll->chunks[k1].cx : row->size;
+    if (row->render && ll->win_end != -1 && ll->win_cx <= start && ll->win_end >= end)
+        return;
+
+    editor_cache_drop(row);
+    ll->win_cx = start;
+    ll->win_rx = ll->chunks[k0].rx;
+    ll->win_end = end;
+}
+
+/*
+ * 在 at 处插入(delta 为 1)或删除(delta 为 -1)一个字节之后更新块索引：之后的块整体平移，
+ * 只重新扫描修改所在的块。列的变化不是制表符宽度的整数倍时，后面含制表符的块也要重新扫描。
+ * 词法状态向后重新计算，直到某一块起点的状态与原来相同为止。
+ */
+static void editor_long_line_edit(EditorRow *row, long at, long delta)
+{
+    LongLine *ll = row->ll;
+    if (!editor_row_is_long(row))
+    {
+        editor_long_line_free(row);
+        return;
+    }
+    ll->win_end = -1;
+
+    long k = editor_long_line_find(ll, at, ROW_CX);
+    for (long j = k + 1; j < ll->n; j++)
+    {
+        ll->chunks[j].cx += delta;
+        ll->chunks[j].lex_cx += delta;
+    }
+
+    /* 删空的块去掉，过大的块分成两块 */
+    if (k + 1 < ll->n && ll->chunks[k + 1].cx == ll->chunks[k].cx)
+        editor_long_line_remove_chunk(ll, k + 1);
+    else if (k > 0 && k + 1 == ll->n && ll->chunks[k].cx == row->size)
+        editor_long_line_remove_chunk(ll, k--);
+    int split = 0;
+    long end = k + 1 < ll->n ? ll->chunks[k + 1].cx : row->size;
+    if (end - ll->chunks[k].cx > 2 * MVIM_LINE_CHUNK)
+    {
+        LineChunk *c = editor_long_line_insert_chunk(ll, k + 1);
+        *c = ll->chunks[k];
+        c->cx = editor_row_char_start(row, ll->chunks[k].cx + MVIM_LINE_CHUNK);
+        c->lex_cx = -1; // 词法状态需要重新计算
+        split = 1;
+    }
+
+    /*
+     * 从修改所在的块开始重新计算列，直到之后的块不再变化或者只是整体平移。
+     * 修改靠近块起点时前一个字符的解码也可能改变，从前一块开始。
+     */
+    long kr = k > 0 && at < ll->chunks[k].cx + 4 ? k - 1 : k;
+    long rx = ll->chunks[kr].rx;
+    for (long j = kr; j < ll->n; j++)
+    {
+        LineChunk *c = &ll->chunks[j];
+        long d = rx - c->rx;
+        if (j > k + split)
         {
-            row->render[idx++] = ' ';
-            /* 补全 tab 的空格数 */
-            while (idx % MVIM_TAB_STOP != 0)
+            if (d == 0)
+                break;
+            if (d % MVIM_TAB_STOP == 0)
+            {
+                for (; j < ll->n; j++)
+                    ll->chunks[j].rx += d;
+                break;
+            }
+        }
+        c->rx = rx;
+        if (j <= k + split || c->has_tab)
+        {
+            long cx = c->cx;
+            long r = editor_long_line_scan(row, &cx, j + 1 < ll->n ? ll->chunks[j + 1].cx : row->size, rx, &c->has_tab);
+            while (j + 1 < ll->n && cx > ll->chunks[j + 1].cx)
+            {
+                /* 修改后一个字符跨过了下一块的起点(无效的 UTF-8 字节拼成了字符)，合并这两块 */
+                editor_long_line_remove_chunk(ll, j + 1);
+                cx = c->cx;
+                r = editor_long_line_scan(row, &cx, j + 1 < ll->n ? ll->chunks[j + 1].cx : row->size, rx, &c->has_tab);
+            }
+            rx = r;
+        }
+        else if (j + 1 < ll->n)
+        {
+            rx = ll->chunks[j + 1].rx + d;
+        }
+    }
+
+    if (ll->lex_in == -1 || ll->lex_epoch != E.hl_epoch || E.syntax == NULL)
+        return;
+
+    /* 分析时会向后查看注释分界符，从记录的位置离修改处足够远的块开始 */
+    long ke = editor_long_line_find(ll, at, ROW_CX);
+    long kk = ke;
+    while (kk > 0 && (ll->chunks[kk].lex_cx == -1 || ll->chunks[kk].lex_cx + LEX_LOOKBACK > at))
+        kk--;
+    int state = ll->chunks[kk].lex_state;
+    long i = ll->chunks[kk].lex_cx;
+    long j;
+    for (j = kk + 1; j < ll->n; j++)
+    {
+        LineChunk *c = &ll->chunks[j];
+        editor_row_flatten(row, c->cx + GAP_LOOKAHEAD);
+        i = editor_syntax_lex_range(row->chars, i, c->cx, row->size, NULL, &state);
+        if (j > ke && i == c->lex_cx && state == c->lex_state)
+            return; // 之后的状态都不会变化
+        c->lex_cx = i;
+        c->lex_state = state;
+    }
+    editor_row_flatten(row, row->size);
+    editor_syntax_lex_range(row->chars, i, row->size, row->size, NULL, &state);
+    ll->lex_out = state & LEX_IN_COMMENT;
+}
+
+/* 生成 render 内容(展开制表符)，同时记录每个制表符和多字节字符的位置 */
+static void editor_render_row(EditorRow *row)
+{
+    long from = 0, to = row->size, rx = 0;
+    if (editor_row_is_long(row))
+    {
+        /* 长行只渲染窗口内的字符，还没有选择窗口时取当前可见的列 */
+        LongLine *ll = editor_long_line(row);
+        if (ll->win_end == -1)
+            editor_long_line_window(row, E.coloff, E.coloff + E.screen_cols);
+        from = ll->win_cx;
+        to = ll->win_end;
+        rx = ll->win_rx;
+    }
+
+    long tabs = 0, leads = 0;
+    long j;
+    int multibyte = row->ll != NULL;
+    editor_row_flatten(row, to + GAP_LOOKAHEAD);
+    /* 计算 tab 和多字节字符的个数 */
+    for (j = from; j < to; j++)
+    {
+        unsigned char ch = row->chars[j];
+        if (ch == '\t')
+            tabs++;
+        else if (ch >= 0x80)
+        {
+            multibyte = 1;
+            if (ch >= 0xc0)
+                leads++;
+        }
+    }
+    /* render、hl 和 stops 依次放在同一块内存中，一次分配、一次释放 */
+    row_free(&E.alloc, row->render);
+    size_t cap = to - from + tabs * (MVIM_TAB_STOP) + 1;
+    size_t stops_off = (2 * cap + sizeof(long) - 1) & ~(sizeof(long) - 1);
+    row->render = row_alloc(&E.alloc, stops_off + sizeof(RenderStop) * (tabs + leads));
+    row->hl = NULL;
+    row->stops = tabs + leads ? (RenderStop *)(row->render + stops_off) : NULL;
+    row->nstops = 0;
+    row->multibyte = multibyte;
+
+    long idx = 0;
+    if (!multibyte)
+    {
+        /* 纯 ASCII 的行只需要展开制表符 */
+        for (j = 0; j < row->size; j++)
+        {
+            /* 处理制表符 */
+            if (row->chars[j] == '\t')
+            {
+                RenderStop *s = &row->stops[row->nstops++];
+                s->at[ROW_CX] = j;
+                s->at[ROW_RX] = s->at[ROW_RB] = idx;
                 row->render[idx++] = ' ';
+                /* 补全 tab 的空格数 */
+                while (idx % MVIM_TAB_STOP != 0)
+                    row->render[idx++] = ' ';
+            }
+            /* 普通字符 */
+            else
+            {
+                row->render[idx++] = row->chars[j];
+            }
         }
-        /* 普通字符 */
-        else
+        row->render[idx] = '\0';
+        row->rsize = idx;
+        return;
+    }
+
+    for (j = from; j < to;)
+    {
+        long span[3];
+        editor_char_span(row, j, rx, span);
+        if (span[ROW_CX] != 1 || span[ROW_RX] != 1 || span[ROW_RB] != 1)
         {
-            row->render[idx++] = row->chars[j];
+            RenderStop *s = &row->stops[row->nstops++];
+            s->at[ROW_CX] = j;
+            s->at[ROW_RX] = rx;
+            s->at[ROW_RB] = idx;
         }
+
+        unsigned char ch = row->chars[j];
+        if (ch == '\t')
+            memset(&row->render[idx], ' ', span[ROW_RB]);
+        else if (ch < 0x80 || (span[ROW_CX] > 1 && span[ROW_RB] == span[ROW_CX]))
+            memcpy(&row->render[idx], &row->chars[j], span[ROW_RB]);
+        else
+            row->render[idx] = '?';
+        j += span[ROW_CX];
+        rx += span[ROW_RX];
+        idx += span[ROW_RB];
     }
     row->render[idx] = '\0';
     row->rsize = idx;
+}
+
+/*
+ * 把行内位置 pos 从坐标 from 转换到 to。特殊字符之间每个字节占一列，
+ * 只需要在索引中二分查找 pos 之前最近的特殊字符。pos 落在一个特殊字符中间时，
+ * 两种坐标的长度相同(展开的制表符、多字节字符的字节)则按偏移对应，否则对应到字符起点。
+ */
+long editor_row_convert(EditorRow *row, long pos, int from, int to)
+{
+    if (from != ROW_RB && to != ROW_RB && editor_row_is_long(row))
+        return editor_long_line_convert(row, pos, from, to);
+    if (row->render == NULL)
+        editor_render_row(row);
+
+    /* 完全在 pos 之前的特殊字符个数 */
+    long span[3];
+    long lo = 0, hi = row->nstops;
+    while (lo < hi)
+    {
+        long mid = lo + (hi - lo) / 2;
+        RenderStop *s = &row->stops[mid];
+        editor_char_span(row, s->at[ROW_CX], s->at[ROW_RX], span);
+        if (s->at[from] + span[from] <= pos)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo < row->nstops && pos >= row->stops[lo].at[from])
+    {
+        RenderStop *s = &row->stops[lo];
+        editor_char_span(row, s->at[ROW_CX], s->at[ROW_RX], span);
+        if (span[from] == span[to])
+            return s->at[to] + (pos - s->at[from]);
+        return s->at[to];
+    }
+
+    /* 长行的 render 从窗口起点开始 */
+    long origin[3] = {0, 0, 0};
+    if (row->ll)
+    {
+        origin[ROW_CX] = row->ll->win_cx;
+        origin[ROW_RX] = row->ll->win_rx;
+    }
+    long base_from = origin[from], base_to = origin[to];
+    if (lo > 0)
+    {
+        RenderStop *s = &row->stops[lo - 1];
+        editor_char_span(row, s->at[ROW_CX], s->at[ROW_RX], span);
+        base_from = s->at[from] + span[from];
+        base_to = s->at[to] + span[to];
+    }
+    long r = base_to + (pos - base_from);
+    if (to == ROW_RB)
+        return r < 0 ? 0 : r > row->rsize ? row->rsize : r;
+    return to == ROW_CX && r > row->size ? row->size : r;
+}
+
+long editor_row_cx_to_rx(EditorRow *row, long cx)
+{
+    return editor_row_convert(row, cx, ROW_CX, ROW_RX);
+}
 
+long editor_row_rx_to_cx(EditorRow *row, long rx)
+{
+    return editor_row_convert(row, rx, ROW_RX, ROW_CX);
+}
+
+/* cx 之前一个字符的起点，多字节字符整个跳过 */
+long editor_row_prev_char(EditorRow *row, long cx)
+{
+    long p = cx - 1;
+    editor_row_flatten(row, cx + GAP_LOOKAHEAD);
+    if ((unsigned char)row->chars[p] < 0x80)
+        return p;
+    for (long s = p; s >= 0 && s >= cx - 4; s--)
+    {
+        if ((row->chars[s] & 0xc0) != 0x80)
+        {
+            int cp;
+            if (s + utf8_decode(&row->chars[s], row->size - s, &cp) == cx)
+                return s;
+            break;
+        }
+    }
+    return p;
+}
+
+/* cx 之后一个字符的起点 */
+long editor_row_next_char(EditorRow *row, long cx)
+{
+    int cp;
+    editor_row_flatten(row, cx + GAP_LOOKAHEAD);
+    if ((unsigned char)row->chars[cx] < 0x80)
+        return cx + 1;
+    return cx + utf8_decode(&row->chars[cx], row->size - cx, &cp);
+}
+
+/* cx 落在多字节字符中间时移到该字符的起点 */
+long editor_row_char_start(EditorRow *row, long cx)
+{
+    if (cx >= row->size)
+        return cx;
+    editor_row_flatten(row, cx + GAP_LOOKAHEAD);
+    if ((row->chars[cx] & 0xc0) != 0x80)
+        return cx;
+    for (long s = cx - 1; s >= 0 && s >= cx - 3; s--)
+    {
+        if ((row->chars[s] & 0xc0) != 0x80)
+        {
+            int cp;
+            if (s + utf8_decode(&row->chars[s], row->size - s, &cp) > cx)
+                return s;
+            break;
+        }
+    }
+    return cx;
+}
+
+/* 行内容改变后丢弃缓存并使之后的注释状态检查点失效，render 和 hl 在显示时重新计算 */
+void editor_update_row(EditorRow *row)
+{
+    editor_long_line_free(row);
+    editor_cache_drop(row);
+    editor_syntax_invalidate(rowstore_index_of(row));
+}
+
+/*
+ * 普通行在 at 处插入(delta 为 1)或删除(delta 为 -1)一个字节之后就地修补 render 和 hl：
+ * 之后的内容整体平移，从修改处之前的安全位置重新分析，直到与原来的高亮重新一致为止。
+ * 高亮已过期、行中有多字节字符或者修改处之后有制表符(宽度会变)时返回 -1，由调用者整行重建。
+ */
+static int editor_render_patch(EditorRow *row, long at, long delta)
+{
+    if (editor_row_is_long(row) || row->render == NULL || row->hl == NULL || row->hl_epoch != E.hl_epoch ||
+        row->multibyte)
+        return -1;
+    if (row->nstops && row->stops[row->nstops - 1].at[ROW_CX] >= at)
+        return -1;
+    unsigned char c = 0;
+    if (delta > 0)
+    {
+        editor_row_flatten(row, at + 1);
+        c = row->chars[at];
+        if (c == '\t' || c >= 0x80)
+            return -1;
+    }
+
+    /* 新的 hl 紧接在 render 之后，stops 在它们后面，放不下时换一块更大的 */
+    long r = row->rsize;
+    long rb = editor_row_convert(row, at, ROW_CX, ROW_RB);
+    size_t soff = (2 * (r + delta) + 1 + sizeof(long) - 1) & ~(sizeof(long) - 1);
+    if (row->stops && (size_t)((char *)row->stops - row->render) > soff)
+        soff = (char *)row->stops - row->render;
+    size_t need = soff + row->nstops * sizeof(RenderStop);
+    if (need > row_alloc_size(row->render))
+    {
+        size_t used = row->stops ? (size_t)((char *)(row->stops + row->nstops) - row->render) : (size_t)(2 * r + 1);
+        char *b = row_alloc(&E.alloc, need + need / 2);
+        memcpy(b, row->render, used);
+        if (row->lru_prev || row->lru_next || E.lru_head == row)
+            E.cache_bytes += row_alloc_size(b) - row_alloc_size(row->render);
+        row_free(&E.alloc, row->render);
+        row->hl = (unsigned char *)b + (row->hl - (unsigned char *)row->render);
+        if (row->stops)
+            row->stops = (RenderStop *)(b + ((char *)row->stops - row->render));
+        row->render = b;
+    }
+    if (row->stops && (char *)row->stops != row->render + soff)
+    {
+        memmove(row->render + soff, row->stops, row->nstops * sizeof(RenderStop));
+        row->stops = (RenderStop *)(row->render + soff);
+    }
+
+    unsigned char *hl = row->hl;
+    if (delta > 0)
+    {
+        memmove(&hl[rb + 2], &hl[rb], r - rb);
+        memmove(&hl[1], &hl[0], rb);
+        hl++;
+        hl[rb] = HL_NORMAL;
+        memmove(&row->render[rb + 1], &row->render[rb], r - rb + 1);
+        row->render[rb] = c;
+    }
+    else
+    {
+        memmove(&row->render[rb], &row->render[rb + 1], r - rb);
+        memmove(&hl[-1], &hl[0], rb);
+        memmove(&hl[rb - 1], &hl[rb + 1], r - rb - 1);
+        hl--;
+    }
+    row->hl = hl;
+    row->rsize = r += delta;
+    if (E.syntax == NULL)
+        return 0;
+
+    /*
+     * 起点之前的字符按普通字符分析过(分析状态只取决于它是不是分隔符)，并且离修改处足够远，
+     * 之前向后查看的内容都没有改变。
+     */
+    long i = rb - LEX_LOOKBACK;
+    while (i > 0 && hl[i - 1] != HL_NORMAL)
+        i--;
+    int state = row->hl_state_in;
+    if (i > 0)
+        state = is_separator(row->render[i - 1]) ? 0 : LEX_NOT_SEP;
+    else
+        i = 0;
+
+    /*
+     * 每次分析到下一个原来按普通字符分析的位置 e，e 之前的字符现在也按普通字符分析时，
+     * 之后的分析和原来完全相同。hl 中 i 之后还是原来的内容，分析之前先清空。
+     */
+    long from = rb + (delta > 0); // 之后的位置都与原来的内容对应
+    while (i < r)
+    {
+        long e = i + 1 > from + 1 ? i + 1 : from + 1;
+        while (e < r && hl[e - 1] != HL_NORMAL)
+            e++;
+        if (e > r)
+            e = r;
+        memset(&hl[i], HL_NORMAL, e - i);
+        i = editor_syntax_lex_range(row->render, i, e, r, hl, &state);
+        if (i == e && e < r && hl[e - 1] == HL_NORMAL)
+            return 0;
+    }
+    row->hl_open_comment = state & LEX_IN_COMMENT;
+    return 0;
+}
+
+/* 行内 at 处插入或删除一个字节之后更新，长行只更新修改所在的块 */
+static void editor_update_row_at(EditorRow *row, long at, long delta)
+{
+    if (row->ll == NULL)
+    {
+        /* 修补之后行尾的注释状态不变时，之后各行的状态也都不变 */
+        int open = row->hl_open_comment;
+        if (editor_render_patch(row, at, delta) == -1)
+            editor_update_row(row);
+        else if (row->hl_open_comment != open)
+            editor_syntax_invalidate(rowstore_index_of(row));
+        return;
+    }
+    editor_long_line_edit(row, at, delta);
+    editor_cache_drop(row);
+    editor_syntax_invalidate(rowstore_index_of(row));
+}
+
+/* 以 state 为行首状态生成行的高亮，内容、语法和行首状态都没变时直接使用缓存 */
+static void editor_row_highlight(EditorRow *row, int state)
+{
+    if (row->render && row->hl && row->hl_epoch == E.hl_epoch && row->hl_state_in == state)
+    {
+        editor_cache_touch(row);
+        return;
+    }
+
+    if (row->render == NULL)
+        editor_render_row(row);
+    row->hl_state_in = state;
     editor_update_syntax(row);
+    editor_cache_touch(row);
+    editor_cache_trim(row);
+}
+
+/* 显示、搜索等第一次需要某一行时才计算它的 render 和 hl，之后使用缓存 */
+void editor_row_prepare(EditorRow *row)
+{
+    editor_row_highlight(row, editor_syntax_state_at(rowstore_index_of(row)));
+}
+
+/* 插入行 row，chars 直接使用传入的内存，owned 为 RowChars */
+static EditorRow *editor_insert_row_ref(EditorRow *row, int at, char *chars, size_t len, int owned)
+{
+    row->size = len;     // 新行的字符长度
+    row->chars = chars;  // 新行的内容
+    row->owned = owned;
+
+    row->rsize = 0;
+    row->render = NULL; // render 和 hl 在需要显示时才计算
+    row->hl = NULL;
+    row->stops = NULL;
+    row->nstops = 0;
+    row->multibyte = 0;
+    row->ll = NULL;
+    row->hl_open_comment = 0;
+    row->hl_state_in = 0;
+    row->hl_epoch = 0;
+    row->lru_prev = NULL;
+    row->lru_next = NULL;
+
+    rowstore_insert(&E.rows, at, row); // 行号由行存储隐式维护
+    E.num_rows++;                      // 行数加一
+    editor_syntax_invalidate(at);      // 之后各行的行号改变，检查点失效
+
+    E.dirty++;
+    return row;
+}
+
+static char *editor_copy_chars(char *s, size_t len)
+{
+    char *chars = row_alloc(&E.alloc, len + 1);
+    memcpy(chars, s, len);
+    chars[len] = '\0'; // 最后一个字符结束标志
+    return chars;
 }
 
 /* 记录一行的信息，包括字符串长度合具体内容 */
@@ -269,45 +1080,69 @@ void editor_insert_row(int at, char *s, size_t len)
     if (at < 0 || at > E.num_rows)
         return;
 
-    E.row = realloc(E.row, sizeof(EditorRow) * (E.num_rows + 1));
-    memmove(&E.row[at + 1], &E.row[at], sizeof(EditorRow) * (E.num_rows - at));
-    for (int j = at + 1; j <= E.num_rows; j++)
-        E.row[j].idx++;
+    EditorRow *row = row_alloc(&E.alloc, sizeof(EditorRow));
+    editor_insert_row_ref(row, at, editor_copy_chars(s, len), len, ROW_CHARS_OWNED);
+    editor_update_row(row); // 实际渲染的行需要处理，加上制表符的空格数
+}
 
-    E.row[at].idx = at;
+/* 写时复制：行第一次被修改时才为其分配自有内存 */
+void editor_row_own(EditorRow *row)
+{
+    editor_row_flatten(row, row->size);
+    if (row->owned == ROW_CHARS_OWNED)
+        return;
 
-    E.row[at].size = len; // 新行的字符长度
-    E.row[at].chars = malloc(len + 1);
-    memcpy(E.row[at].chars, s, len); // 新行的内容
-    E.row[at].chars[len] = '\0';     // 最后一个字符结束标志
+    row->chars = editor_copy_chars(row->chars, row->size);
+    row->owned = ROW_CHARS_OWNED;
+}
 
-    E.row[at].rsize = 0;
-    E.row[at].render = NULL;
-    E.row[at].hl = NULL;
-    E.row[at].hl_open_comment = 0;
-    editor_update_row(&E.row[at]); // 实际渲染的行需要处理，加上制表符的空格数
+/*
+ * 把行的输入间隙移到 at，连续输入和删除时间隙一直在光标处，只需要移动很少的字节。
+ * 其他行的间隙先去掉，间隙用完时按分配器的增长策略扩大。
+ */
+static void editor_row_gap(EditorRow *row, long at)
+{
+    if (E.gap.row != row)
+    {
+        editor_gap_close();
+        editor_row_own(row);
+        E.gap.row = row;
+        E.gap.at = row->size;
+        E.gap.len = row_alloc_size(row->chars) - row->size - 1;
+    }
+    if (E.gap.len == 0)
+    {
+        /* 扩大之后间隙后面的内容移到新的末尾 */
+        row->chars = row_realloc(&E.alloc, row->chars, row->size + 2);
+        long len = row_alloc_size(row->chars) - row->size - 1;
+        memmove(&row->chars[E.gap.at + len], &row->chars[E.gap.at], row->size - E.gap.at);
+        E.gap.len = len;
+    }
 
-    E.num_rows++; // 行数加一
-    E.dirty++;
+    if (at < E.gap.at)
+        memmove(&row->chars[at + E.gap.len], &row->chars[at], E.gap.at - at);
+    else
+        memmove(&row->chars[E.gap.at], &row->chars[E.gap.at + E.gap.len], at - E.gap.at);
+    E.gap.at = at;
 }
 
-void eidtor_row_insert_char(EditorRow *row, int at, int c)
+void eidtor_row_insert_char(EditorRow *row, long at, int c)
 {
     if (at < 0 || at > row->size)
         at = row->size;
 
-    row->chars = realloc(row->chars, row->size + 2);
-    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1); // 将 at 位置后面的内容后移
-
+    editor_row_gap(row, at);
+    row->chars[E.gap.at++] = c;
+    E.gap.len--;
     row->size++;
-    row->chars[at] = c;
-    editor_update_row(row);
+    editor_update_row_at(row, at, 1);
     E.dirty++;
 }
 
 void editor_row_append_string(EditorRow *row, char *s, size_t len)
 {
-    row->chars = realloc(row->chars, row->size + len + 1);
+    editor_row_own(row);
+    row->chars = row_realloc(&E.alloc, row->chars, row->size + len + 1);
     memcpy(&row->chars[row->size], s, len);
     row->size += len;
     row->chars[row->size] = '\0';
@@ -315,28 +1150,68 @@ void editor_row_append_string(EditorRow *row, char *s, size_t len)
     E.dirty++;
 }
 
+/* 恢复日志是否可用，第一次修改时才创建 */
+static int editor_journal_ready()
+{
+    if (E.filename == NULL)
+        return 0;
+    if (E.journal.fd == -1 && !E.journal.failed && !E.journal.waiting &&
+        journal_open(&E.journal, E.filename, 0) == -1 && E.journal.failed)
+        editor_set_status_message("Cannot create recovery journal, edits are not protected");
+    return E.journal.fd != -1;
+}
+
+/* 记录一次插入：加入撤销日志并写入恢复日志，撤销、重做和重放时不记录 */
+static void editor_log_insert(int row, long col, const char *s, size_t len, int append_row)
+{
+    if (E.undo.applying)
+        return;
+    undo_insert(&E.undo, row, col, s, len, append_row);
+    if (editor_journal_ready())
+        journal_insert(&E.journal, row, col, s, len, append_row);
+}
+
+/* 记录删除一个字符 */
+static void editor_log_delete(int row, long col, char c)
+{
+    if (E.undo.applying)
+        return;
+    undo_delete(&E.undo, row, col, c);
+    if (editor_journal_ready())
+        journal_delete(&E.journal, row, col, 1);
+}
+
 /* 插入字符 */
 void editor_insert_char(int c)
 {
-    if (E.cy == E.num_rows)
+    int append = E.cy == E.num_rows;
+    if (append)
     {
         editor_insert_row(E.num_rows, "", 0);
     }
-    eidtor_row_insert_char(&E.row[E.cy], E.cx, c);
+    char ch = c;
+    editor_log_insert(E.cy, E.cx, &ch, 1, append);
+    eidtor_row_insert_char(editor_row_at(E.cy), E.cx, c);
     E.cx++;
 }
 
 void editor_insert_newline()
 {
+    /* 在文件末尾新增一行没有插入文本，撤销时删除该行 */
+    if (E.cy == E.num_rows)
+        editor_log_insert(E.cy, 0, "", 0, 1);
+    else
+        editor_log_insert(E.cy, E.cx, "\n", 1, 0);
+
     if (E.cx == 0)
     {
         editor_insert_row(E.cy, "", 0);
     }
     else
     {
-        EditorRow *row = &E.row[E.cy];
+        EditorRow *row = editor_row_at(E.cy);
+        editor_row_own(row);
         editor_insert_row(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-        row = &E.row[E.cy];
         row->size = E.cx;
         row->chars[row->size] = '\0';
         editor_update_row(row);
@@ -345,109 +1220,519 @@ void editor_insert_newline()
     E.cx = 0;
 }
 
+/*
+ * 一次性插入一段文本，中间的行直接插入，光标所在行只拆分一次。
+ * crlf 为 1 时(粘贴)"\r" 和 "\r\n" 也算换行，否则只按 "\n" 分行。整段文本作为一条撤销记录。
+ */
+void editor_insert_text(const char *s, size_t len, int crlf)
+{
+    int append = E.cy == E.num_rows;
+    if (append)
+        editor_insert_row(E.num_rows, "", 0);
+
+    undo_seal(&E.undo);
+    int ur = E.cy; // 撤销记录中下一段文本的位置
+    long uc = E.cx;
+
+    /* 光标后面的内容接到插入文本的最后一行后面 */
+    EditorRow *row = editor_row_at(E.cy);
+    editor_row_own(row);
+    size_t tail_len = row->size - E.cx;
+    char *tail = editor_copy_chars(&row->chars[E.cx], tail_len);
+    row->size = E.cx;
+    row->chars[row->size] = '\0';
+
+    const char *p = s;
+    const char *end = s + len;
+    while (1)
+    {
+        const char *eol = p;
+        while (eol < end && *eol != '\n' && !(crlf && *eol == '\r'))
+            eol++;
+
+        editor_log_insert(ur, uc, p, eol - p, append);
+        uc += eol - p;
+        append = 0;
+        if (eol < end)
+        {
+            editor_log_insert(ur, uc, "\n", 1, 0);
+            ur++;
+            uc = 0;
+        }
+
+        if (p == s)
+        {
+            editor_row_append_string(row, (char *)p, eol - p);
+        }
+        else
+        {
+            editor_insert_row(E.cy + 1, (char *)p, eol - p);
+            E.cy++;
+        }
+
+        if (eol >= end)
+            break;
+        /* "\r\n" 只算一个换行 */
+        if (crlf && *eol == '\r' && eol + 1 < end && eol[1] == '\n')
+            eol++;
+        p = eol + 1;
+    }
+
+    row = editor_row_at(E.cy);
+    E.cx = row->size;
+    editor_row_append_string(row, tail, tail_len);
+    row_free(&E.alloc, tail);
+    undo_seal(&E.undo);
+}
+
+/* 从 at 行 col 处开始删除 len 个字节(换行符算一个字节)，跨越的行一次性拼接 */
+void editor_delete_text(int at, long col, size_t len)
+{
+    /* 找到删除范围的终点 */
+    editor_gap_close();
+    RowIter it;
+    EditorRow *row = rowstore_seek(&E.rows, at, &it);
+    EditorRow *end = row;
+    int end_at = at;
+    size_t end_col = col + len;
+    while (end_col > (size_t)end->size)
+    {
+        end_col -= end->size + 1;
+        end = rowstore_next(&it);
+        end_at++;
+    }
+
+    editor_row_own(row);
+    if (end == row)
+    {
+        memmove(&row->chars[col], &row->chars[end_col], row->size - end_col + 1);
+        row->size -= len;
+        editor_update_row(row);
+        E.dirty++;
+        return;
+    }
+
+    /* 终点之后的内容接到起点所在行，中间的行全部删除 */
+    row->size = col;
+    row->chars[col] = '\0';
+    editor_row_append_string(row, &end->chars[end_col], end->size - end_col);
+    for (int k = at; k < end_at; k++)
+        editor_del_row(at + 1);
+}
+
 /* 删除字符 */
-void editor_row_del_char(EditorRow *row, int at)
+void editor_row_del_char(EditorRow *row, long at)
 {
     if (at < 0 || at >= row->size)
         return;
-    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
+    editor_row_gap(row, at);
+    E.gap.len++; // at 处的字节并入间隙
     row->size--;
-    editor_update_row(row);
+    editor_update_row_at(row, at, -1);
     E.dirty++;
 }
 
-void editor_del_char()
+void editor_del_char()
+{
+    if (E.cy == E.num_rows)
+        return;
+    if (E.cx == 0 && E.cy == 0)
+        return;
+    EditorRow *row = editor_row_at(E.cy); // 获取所在行
+    /* 光标前还有字符 */
+    if (E.cx > 0)
+    {
+        /* 多字节字符的所有字节一起删除 */
+        long start = editor_row_prev_char(row, E.cx);
+        while (E.cx > start)
+        {
+            editor_row_flatten(row, E.cx);
+            editor_log_delete(E.cy, E.cx - 1, row->chars[E.cx - 1]);
+            editor_row_del_char(row, E.cx - 1);
+            E.cx--;
+        }
+    }
+    /* 光标前没有字符 */
+    else
+    {
+        EditorRow *prev = editor_row_at(E.cy - 1);
+        editor_log_delete(E.cy - 1, prev->size, '\n');
+        E.cx = prev->size;
+        editor_row_flatten(row, row->size);
+        editor_row_append_string(prev, row->chars, row->size);
+        editor_del_row(E.cy);
+        E.cy--;
+    }
+}
+
+/* 撤销最近一条记录，整段文本一次性删除或插入 */
+void editor_undo()
+{
+    UndoRecord *rec = undo_step_back(&E.undo);
+    if (rec == NULL)
+    {
+        editor_set_status_message("Already at oldest change");
+        return;
+    }
+
+    int journal = editor_journal_ready();
+    E.undo.applying = 1;
+    if (rec->kind == UNDO_INSERT)
+    {
+        editor_delete_text(rec->row, rec->col, rec->len);
+        if (journal)
+            journal_delete(&E.journal, rec->row, rec->col, rec->len);
+        if (rec->append_row)
+        {
+            editor_del_row(rec->row);
+            if (journal)
+                journal_del_row(&E.journal, rec->row);
+        }
+        E.cy = rec->row;
+        E.cx = rec->col;
+    }
+    else
+    {
+        char *text = undo_text(rec);
+        E.cy = rec->row;
+        E.cx = rec->col;
+        editor_insert_text(text, rec->len, 0);
+        if (journal)
+            journal_insert(&E.journal, rec->row, rec->col, text, rec->len, 0);
+        free(text);
+        /* 退格删除的文本恢复后光标在其末尾，向后删除的光标在其开头 */
+        if (!rec->reversed)
+        {
+            E.cy = rec->row;
+            E.cx = rec->col;
+        }
+    }
+    E.undo.applying = 0;
+}
+
+/* 重做下一条记录 */
+void editor_redo()
+{
+    UndoRecord *rec = undo_step_forward(&E.undo);
+    if (rec == NULL)
+    {
+        editor_set_status_message("Already at newest change");
+        return;
+    }
+
+    int journal = editor_journal_ready();
+    E.undo.applying = 1;
+    E.cy = rec->row;
+    E.cx = rec->col;
+    if (rec->kind == UNDO_INSERT)
+    {
+        if (rec->append_row)
+            editor_insert_row(E.num_rows, "", 0);
+        char *text = undo_text(rec);
+        editor_insert_text(text, rec->len, 0);
+        if (journal)
+            journal_insert(&E.journal, rec->row, rec->col, text, rec->len, rec->append_row);
+        free(text);
+    }
+    else
+    {
+        editor_delete_text(rec->row, rec->col, rec->len);
+        if (journal)
+            journal_delete(&E.journal, rec->row, rec->col, rec->len);
+    }
+    E.undo.applying = 0;
+}
+
+void editor_free_row(EditorRow *row)
+{
+    if (row == E.gap.row)
+        E.gap.row = NULL;
+    editor_long_line_free(row);
+    editor_cache_drop(row);
+    if (row->owned == ROW_CHARS_OWNED)
+        row_free(&E.alloc, row->chars);
+}
+
+void editor_del_row(int at)
+{
+    if (at < 0 || at >= E.num_rows)
+        return;
+    EditorRow *row = rowstore_remove(&E.rows, at);
+    editor_free_row(row);
+    editor_syntax_invalidate(at);
+    row_free(&E.alloc, row);
+    E.num_rows--;
+    E.dirty++;
+}
+
+/* 关闭当前文件：行结构、行内容和渲染缓存都在 E.alloc 中，整体释放而不逐行释放 */
+void editor_close()
+{
+    rowstore_free(&E.rows, NULL);
+    row_alloc_reset(&E.alloc);
+    E.gap.row = NULL;
+    if (E.map)
+    {
+        munmap(E.map, E.map_len);
+        E.map = NULL;
+        E.map_len = 0;
+    }
+    E.num_rows = 0;
+    E.cx = E.cy = E.rx = 0;
+    E.rowoff = E.coloff = 0;
+    E.lru_head = E.lru_tail = NULL;
+    E.cache_bytes = 0;
+    E.hl_cp_valid = 0;
+    match_index_free(&E.matches);
+    undo_free(&E.undo);
+    E.dirty = 0;
+}
+
+void editor_open(const char *filename)
+{
+    editor_close();
+    free(E.filename);
+    E.filename = strdup(filename);
+
+    editor_select_syntax_highlight();
+
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1)
+        die("open");
+
+    /* 普通文件直接映射，不逐行读取和复制 */
+    if (editor_open_mmap(fd) == 0)
+    {
+        close(fd);
+    }
+    else
+    {
+        FILE *fp = fdopen(fd, "r");
+        if (!fp)
+            die("fdopen");
+
+        char *line = NULL;
+        size_t linecap = 0;
+        ssize_t linelen;
+
+        /* 将文件内容读取到 E.rows 中 */
+        while ((linelen = getline(&line, &linecap, fp)) != -1)
+        {
+            /* 减去回车换行的个数 */
+            while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
+                linelen--;
+
+            /* 行结构和内容从 arena 连续分配，render 和 hl 推迟到显示时计算 */
+            EditorRow *row = row_arena_alloc(&E.alloc, sizeof(EditorRow) + linelen + 1);
+            char *chars = (char *)(row + 1);
+            memcpy(chars, line, linelen);
+            chars[linelen] = '\0';
+            editor_insert_row_ref(row, E.num_rows, chars, linelen, ROW_CHARS_INLINE);
+        }
+
+        free(line);
+        fclose(fp);
+    }
+    E.dirty = 0;
+    editor_recover();
+}
+
+/* (at, col) 之后是否还有 len 个字节，用于检查日志中的操作 */
+static int editor_text_fits(int at, long col, size_t len)
+{
+    if (at < 0 || at >= E.num_rows)
+        return 0;
+    RowIter it;
+    EditorRow *row = rowstore_seek(&E.rows, at, &it);
+    if (col < 0 || col > row->size)
+        return 0;
+    size_t end_col = col + len;
+    while (end_col > (size_t)row->size)
+    {
+        end_col -= row->size + 1;
+        row = rowstore_next(&it);
+        if (row == NULL)
+            return 0;
+    }
+    return 1;
+}
+
+/* 重放恢复日志中的一条操作，与当前内容不符时返回 -1 停止重放 */
+static int editor_replay_op(const JournalOp *op)
+{
+    if (op->kind == JOURNAL_APPEND)
+    {
+        if (op->row != E.num_rows || op->col != 0)
+            return -1;
+        editor_insert_row(E.num_rows, "", 0);
+    }
+
+    if (op->kind == JOURNAL_INSERT || op->kind == JOURNAL_APPEND)
+    {
+        if (!editor_text_fits(op->row, op->col, 0))
+            return -1;
+        E.cy = op->row;
+        E.cx = op->col;
+        editor_insert_text(op->text, op->len, 0);
+    }
+    else if (op->kind == JOURNAL_DELETE)
+    {
+        if (!editor_text_fits(op->row, op->col, op->len))
+            return -1;
+        editor_delete_text(op->row, op->col, op->len);
+        E.cy = op->row;
+        E.cx = op->col;
+    }
+    else if (op->kind == JOURNAL_DEL_ROW)
+    {
+        if (op->row < 0 || op->row >= E.num_rows)
+            return -1;
+        editor_del_row(op->row);
+        E.cy = op->row;
+        E.cx = 0;
+    }
+    else
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/* 打开文件时发现上次没有保存的修改，询问是否重放 */
+void editor_recover()
 {
-    if (E.cy == E.num_rows)
+    int r = journal_check(E.filename);
+    if (r == -1)
         return;
-    if (E.cx == 0 && E.cy == 0)
-        return;
-    EditorRow *row = &E.row[E.cy]; // 获取所在行
-    /* 光标前还有字符 */
-    if (E.cx > 0)
+    if (r == -2)
     {
-        editor_row_del_char(row, E.cx - 1);
-        E.cx--;
+        /* 另一个 mvim 正在编辑这个文件，不能碰它的日志 */
+        E.journal.failed = 1;
+        editor_set_status_message("File is open in another mvim, recovery journal disabled");
+        return;
     }
-    /* 光标前没有字符 */
-    else
+    if (r == 0)
     {
-        E.cx = E.row[E.cy - 1].size;
-        editor_row_append_string(&E.row[E.cy - 1], row->chars, row->size);
-        editor_del_row(E.cy);
-        E.cy--;
+        /* 日志中可能还有其他版本的修改，改名保留，之后的修改使用新的日志 */
+        char *aside = journal_set_aside(E.filename);
+        if (aside)
+        {
+            const char *name = strrchr(aside, '/');
+            editor_set_status_message("Recovery journal does not match the file, kept as %s", name ? name + 1 : aside);
+        }
+        else
+            editor_set_status_message("Recovery journal does not match the file, kept it and disabled journaling");
+        E.journal.failed = aside == NULL;
+        free(aside);
+        return;
     }
-}
 
-void editor_free_row(EditorRow *row)
-{
-    free(row->render);
-    free(row->chars);
-    free(row->hl);
-}
+    /* 先锁住日志再询问，同时打开这个文件的其他 mvim 不会再重放或删除它 */
+    if (journal_open(&E.journal, E.filename, 1) == -1)
+    {
+        editor_set_status_message("File is open in another mvim, recovery journal disabled");
+        return;
+    }
 
-void editor_del_row(int at)
-{
-    if (at < 0 || at >= E.num_rows)
+    char *answer = editor_prompt("Unsaved edits found, recover them? (y/n): %s", NULL);
+    int yes = answer && (answer[0] == 'y' || answer[0] == 'Y');
+    free(answer);
+    if (!yes)
+    {
+        journal_close(&E.journal, 1);
+        editor_set_status_message("Recovery journal discarded");
         return;
-    editor_free_row(&E.row[at]);
-    memmove(&E.row[at], &E.row[at + 1], sizeof(EditorRow) * (E.num_rows - at - 1));
-    for (int j = at; j < E.num_rows - 1; j++)
-        E.row[j].idx--;
-    E.num_rows--;
-    E.dirty++;
+    }
+
+    /* 之后的修改继续追加到同一个日志 */
+    E.undo.applying = 1;
+    long n = journal_replay(E.filename, editor_replay_op);
+    E.undo.applying = 0;
+    editor_set_status_message("Recovered %ld edits", n);
 }
 
-void editor_open(const char *filename)
+/* 映射整个文件并只建立行偏移索引，行内容指向映射，修改时再复制 */
+int editor_open_mmap(int fd)
 {
-    free(E.filename);
-    E.filename = strdup(filename);
-
-    editor_select_syntax_highlight();
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0)
+        return -1;
 
-    FILE *fp = fopen(filename, "r");
-    if (!fp)
-        die("fopen");
+    size_t len = st.st_size;
+    char *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        return -1;
 
-    char *line = NULL;
-    size_t linecap = 0;
-    ssize_t linelen;
+    E.map = map;
+    E.map_len = len;
 
-    /* 将文件内容读取到 E.row 中 */
-    while ((linelen = getline(&line, &linecap, fp)) != -1)
+    char *p = map;
+    char *end = map + len;
+    while (p < end)
     {
-        /* 减去回车换行的个数 */
-        while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
+        char *nl = memchr(p, '\n', end - p);
+        char *eol = nl ? nl : end;
+        size_t linelen = eol - p;
+
+        /* 去掉行尾的回车符 */
+        while (linelen > 0 && p[linelen - 1] == '\r')
             linelen--;
 
-        /* 读取一行内容 */
-        editor_insert_row(E.num_rows, line, linelen);
+        editor_insert_row_ref(row_arena_alloc(&E.alloc, sizeof(EditorRow)), E.num_rows, p, linelen, ROW_CHARS_MAPPED);
+        p = nl ? nl + 1 : end;
     }
-
-    free(line);
-    fclose(fp);
-    E.dirty = 0;
+    return 0;
 }
 
-char *editor_rows_to_string(int *buflen)
+/* 把所有行按 writev 批量写入 fd，每一行后面加一个换行符，返回写入的字节数，出错返回 -1 */
+long long editor_write_rows(int fd)
 {
-    int totlen = 0;
-    int j;
-    /* 获取所有内容总长度，每一行预留一个换行符 */
-    for (j = 0; j < E.num_rows; j++)
-        totlen += E.row[j].size + 1;
-
-    *buflen = totlen;
-    char *buf = malloc(totlen);
-    char *p = buf;
-    for (j = 0; j < E.num_rows; j++)
+    static char newline = '\n';
+    struct iovec iov[MVIM_SAVE_IOV];
+    long long total = 0;
+    editor_gap_close();
+    RowIter it;
+    EditorRow *row = rowstore_seek(&E.rows, 0, &it);
+    while (row)
     {
-        memcpy(p, E.row[j].chars, E.row[j].size);
-        p += E.row[j].size;
-        *p = '\n';
-        p++;
+        int cnt = 0;
+        for (; row && cnt + 2 <= MVIM_SAVE_IOV; row = rowstore_next(&it))
+        {
+            if (row->size > 0)
+            {
+                iov[cnt].iov_base = row->chars;
+                iov[cnt++].iov_len = row->size;
+            }
+            iov[cnt].iov_base = &newline;
+            iov[cnt++].iov_len = 1;
+        }
+
+        /* 处理部分写入：跳过已经写完的部分继续写 */
+        struct iovec *v = iov;
+        while (cnt > 0)
+        {
+            ssize_t n = writev(fd, v, cnt);
+            if (n == -1)
+            {
+                if (errno == EINTR)
+                    continue;
+                return -1;
+            }
+            total += n;
+            while (cnt > 0 && (size_t)n >= v->iov_len)
+            {
+                n -= v->iov_len;
+                v++;
+                cnt--;
+            }
+            if (cnt > 0)
+            {
+                v->iov_base = (char *)v->iov_base + n;
+                v->iov_len -= n;
+            }
+        }
     }
-    return buf;
+    return total;
 }
 
 void editor_set_status_message(const char *fmt, ...)
@@ -461,80 +1746,91 @@ void editor_set_status_message(const char *fmt, ...)
 
 void editor_find_callback(char *query, int key)
 {
-    static int last_match = -1;
-    static int direction = 1;
-
     static int saved_hl_line;
     static char *saved_hl = NULL;
     if (saved_hl)
     {
-        memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
+        EditorRow *row = editor_row_at(saved_hl_line);
+        if (row->ll)
+        {
+            editor_cache_drop(row); // 长行的窗口可能已经移动，重新高亮窗口即可
+        }
+        else
+        {
+            editor_row_prepare(row);
+            memcpy(row->hl, saved_hl, row->rsize);
+        }
         free(saved_hl);
         saved_hl = NULL;
     }
 
+    MatchIndex *mi = &E.matches;
     if (key == '\r' || key == '\x1b')
     {
-        last_match = -1;
-        direction = 1;
+        match_index_free(mi);
+        mi->active = 0;
         return;
     }
-    else if (key == ARROW_RIGHT || key == ARROW_DOWN)
+
+    int current;
+    if ((key == ARROW_RIGHT || key == ARROW_DOWN || key == ARROW_LEFT || key == ARROW_UP) && mi->current != -1)
     {
-        direction = 1;
+        /* 在索引中二分查找上一个/下一个匹配，到达文件边界后回绕 */
+        int dir = key == ARROW_RIGHT || key == ARROW_DOWN ? 1 : -1;
+        Match *m = &mi->m[mi->current];
+        current = match_index_find(mi, m->row, m->col, dir);
     }
-    else if (key == ARROW_LEFT || key == ARROW_UP)
+    else if (mi->query == NULL || strcmp(mi->query, query) != 0)
     {
-        direction = -1;
+        /* 搜索内容改变，重新搜索整个缓冲区，跳到第一个匹配 */
+        mi->active = 1;
+        editor_gap_close();
+        if (match_index_build(mi, &E.rows, query, E.search_regex) == -1)
+            return; // 正则表达式还没有输入完整
+        current = mi->n ? 0 : -1;
     }
     else
     {
-        last_match = -1;
-        direction = 1;
-    }
-    if (last_match == -1)
-        direction = 1;
-    int current = last_match;
-
-    /* 遍历每一行 */
-    int i;
-    for (i = 0; i < E.num_rows; i++)
-    {
-        current += direction;
-        if (current == -1)
-            current = E.num_rows - 1;
-        else if (current == E.num_rows)
-            current = 0;
-        EditorRow *row = &E.row[current];
-        char *match = strstr(row->render, query); // 匹配字符串
-        if (match)
-        {
-            last_match = current;
-            E.cy = current;
-            /* 光标跳转过去 */
-            E.cy = i;
-            E.cx = editor_row_rx_to_cx(row, match - row->render);
-            E.cx = match - row->render;
-            E.rowoff = E.num_rows;
-
-            saved_hl_line = current;
-            saved_hl = malloc(row->rsize);
-            memcpy(saved_hl, row->hl, row->rsize);
-            memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-            break;
-        }
+        return;
+    }
+    mi->current = current;
+    if (current == -1)
+        return;
+
+    /* 光标跳转过去 */
+    Match *m = &mi->m[current];
+    EditorRow *row = editor_row_at(m->row);
+    size_t mlen = match_index_length(mi, row, m->col);
+    E.cy = m->row;
+    E.cx = m->col;
+    E.rowoff = E.num_rows;
+
+    if (editor_row_is_long(row))
+    {
+        /* 长行的窗口要包含匹配，滚动之后也能覆盖可见的列 */
+        long rx = editor_row_cx_to_rx(row, m->col);
+        editor_long_line_window(row, rx - E.screen_cols, rx + E.screen_cols);
     }
+    editor_row_prepare(row);
+    saved_hl_line = m->row;
+    saved_hl = malloc(row->rsize);
+    memcpy(saved_hl, row->hl, row->rsize);
+    long rb = editor_row_convert(row, m->col, ROW_CX, ROW_RB);
+    long rb_end = editor_row_convert(row, m->col + mlen, ROW_CX, ROW_RB);
+    memset(&row->hl[rb], HL_MATCH, rb_end - rb);
 }
 
-void editor_find()
+void editor_find(int regex)
 {
     /* 保存坐标 */
-    int saved_cx = E.cx;
+    long saved_cx = E.cx;
     int saved_cy = E.cy;
-    int saved_coloff = E.coloff;
+    long saved_coloff = E.coloff;
     int saved_rowoff = E.rowoff;
 
-    char *query = editor_prompt("Search: %s (Use ESC/Arrows/Enter)", editor_find_callback);
+    E.search_regex = regex;
+    char *query = editor_prompt(regex ? "Regex: %s (Use ESC/Arrows/Enter)" : "Search: %s (Use ESC/Arrows/Enter)",
+                                editor_find_callback);
     if (query)
     {
         free(query);
@@ -562,46 +1858,204 @@ void editor_save()
         editor_select_syntax_highlight();
     }
 
-    int len;
-    char *buf = editor_rows_to_string(&len);
-    int fd = open(E.filename, O_RDWR | O_CREAT, 0644); // 以读写的方式打开文件，没有就创建一个 | rw-r--r--
+    if (E.save_pid != -1)
+    {
+        editor_set_status_message("Save already in progress");
+        return;
+    }
+
+    /* 记下快照对应的日志位置，保存成功后只保留之后的修改 */
+    E.save_journal_off = journal_offset(&E.journal);
+
+    /* 子进程得到缓冲区的写时复制快照并写入文件，父进程继续编辑，结果通过管道返回 */
+    int fds[2];
+    pid_t pid = -1;
+    if (pipe(fds) == 0)
+    {
+        pid = fork();
+        if (pid == -1)
+        {
+            close(fds[0]);
+            close(fds[1]);
+        }
+    }
+    if (pid == 0)
+    {
+        close(fds[0]);
+        SaveResult res;
+        res.len = editor_write_file(E.filename);
+        res.err = errno;
+        write(fds[1], &res, sizeof(res));
+        _exit(0); // 不执行 atexit 注册的函数，终端仍由父进程使用
+    }
+    if (pid == -1)
+    {
+        /* 无法创建子进程时直接保存 */
+        long long len = editor_write_file(E.filename);
+        editor_save_finish(len, errno, E.dirty);
+        return;
+    }
+
+    close(fds[1]);
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    E.save_pid = pid;
+    E.save_fd = fds[0];
+    E.save_dirty = E.dirty;
+    editor_set_status_message("Saving in background...");
+}
+
+/* 写入临时文件后重命名覆盖 filename，返回写入的字节数，出错返回 -1 并设置 errno */
+long long editor_write_file(const char *filename)
+{
+    /*
+     * 先写到同一目录下的临时文件并同步到磁盘，再原子地重命名覆盖原文件，
+     * 中途出错原文件保持不变。原文件的映射仍然引用旧的 inode，不需要复制映射中的行。
+     */
+    char *path = realpath(filename, NULL); // 符号链接写到它指向的文件
+    const char *target = path ? path : filename;
+    size_t tlen = strlen(target);
+    char *tmp = malloc(tlen + sizeof(".XXXXXX"));
+    if (tmp == NULL)
+        die("malloc");
+    memcpy(tmp, target, tlen);
+    memcpy(tmp + tlen, ".XXXXXX", sizeof(".XXXXXX"));
+
+    long long len = -1;
+    int fd = mkstemp(tmp);
     if (fd != -1)
     {
-        if (ftruncate(fd, len) != -1)
+        /* 保留原文件的权限，新文件按 umask 使用 rw-r--r-- */
+        struct stat st;
+        mode_t mode;
+        if (stat(target, &st) == 0)
         {
-            if (write(fd, buf, len) == len)
-            {
-                close(fd);
-                free(buf);
-                E.dirty = 0;
-                editor_set_status_message("%d bytes written to disk", len);
-                return;
-            }
+            mode = st.st_mode & 07777;
+        }
+        else
+        {
+            mode_t mask = umask(0);
+            umask(mask);
+            mode = 0644 & ~mask;
+        }
+
+        if (fchmod(fd, mode) == -1 || (len = editor_write_rows(fd)) == -1 || fsync(fd) == -1)
+            len = -1;
+        if (close(fd) == -1)
+            len = -1;
+        if (len != -1)
+            journal_mark_save(&E.journal, tmp, E.save_journal_off); // 替换之后崩溃时可以从这里重放
+        if (len != -1 && rename(tmp, target) == -1)
+            len = -1;
+        if (len == -1)
+        {
+            int saved = errno;
+            unlink(tmp);
+            errno = saved;
         }
+        else
+        {
+            editor_sync_dir(target);
+        }
+    }
+    free(tmp);
+    free(path);
+
+    return len;
+}
+
+/* 报告保存结果，快照之后没有新的修改时才清除修改标记 */
+void editor_save_finish(long long len, int err, int dirty)
+{
+    if (len == -1)
+    {
+        editor_set_status_message("Can't save! I/O error: %s", strerror(err));
+        return;
+    }
+    if (E.dirty == dirty)
+    {
+        /* 文件和缓冲区一致，之前因为文件不存在而没有创建的日志可以从这里开始 */
+        E.dirty = 0;
+        E.journal.waiting = 0;
+    }
+    journal_rebase(&E.journal, E.filename, E.save_journal_off);
+    editor_set_status_message("%lld bytes written to disk", len);
+}
+
+/* 后台保存结束(管道可读)时取回结果，管道还没有数据时阻塞等待 */
+void editor_save_collect()
+{
+    if (E.save_pid == -1)
+        return;
+
+    SaveResult res;
+    ssize_t n;
+    while ((n = read(E.save_fd, &res, sizeof(res))) == -1 && errno == EINTR)
+        ;
+    close(E.save_fd);
+    while (waitpid(E.save_pid, NULL, 0) == -1 && errno == EINTR)
+        ;
+    E.save_pid = -1;
+    E.save_fd = -1;
+
+    /* 子进程异常退出，没有返回结果 */
+    if (n != sizeof(res))
+    {
+        res.len = -1;
+        res.err = EIO;
+    }
+    editor_save_finish(res.len, res.err, E.save_dirty);
+}
+
+
+/* 同步文件所在的目录，保证重命名也写入磁盘 */
+void editor_sync_dir(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    char *dir = slash ? strndup(path, slash == path ? 1 : slash - path) : strdup(".");
+    if (dir == NULL)
+        die("strdup");
+    int fd = open(dir, O_RDONLY);
+    if (fd != -1)
+    {
+        fsync(fd);
         close(fd);
     }
-    free(buf);
-    editor_set_status_message("Can't save! I/O error: %s", strerror(errno));
+    free(dir);
 }
 
 /* 生成所有需要打印信息 */
 void ab_append(AppendBuffer *ab, const char *s, int len)
 {
-    char *new = realloc(ab->b, ab->len + len);
-    if (NULL == new)
-        return;
-
-    memcpy(&new[ab->len], s, len); // 将新的内容添加到尾部
+    /* 容量不够时按两倍增长，稳定后每一帧都不再分配内存 */
+    if (ab->len + len > ab->cap)
+    {
+        int cap = ab->cap ? ab->cap : ABUF_MIN_CAP;
+        while (cap < ab->len + len)
+            cap *= 2;
+
+        char *new = realloc(ab->b, cap);
+        if (NULL == new)
+            die("realloc");
+        ab->b = new;
+        ab->cap = cap;
+    }
 
-    /* 更新数据 */
-    ab->b = new;
+    memcpy(&ab->b[ab->len], s, len); // 将新的内容添加到尾部
     ab->len = ab->len + len;
 }
 
+void ab_reset(AppendBuffer *ab)
+{
+    ab->len = 0;
+}
+
 /* 释放资源 */
 void ab_free(AppendBuffer *ab)
 {
     free(ab->b);
+    ab->b = NULL;
+    ab->len = 0;
+    ab->cap = 0;
 }
 
 /* 滚屏 */
@@ -611,7 +2065,7 @@ void editor_scroll()
 
     if (E.cy < E.num_rows)
     {
-        E.rx = editor_row_cx_to_rx(&E.row[E.cy], E.cx);
+        E.rx = editor_row_cx_to_rx(editor_row_at(E.cy), E.cx);
     }
 
     /* 往上滚动 */
@@ -642,10 +2096,15 @@ void editor_scroll()
 /* 输出数据到屏幕 */
 void editor_draw_rows(AppendBuffer *ab)
 {
+    static AppendBuffer line = ABUF_INIT; // 一行的输出内容，与上一帧比较后再输出
     int y;
+    RowIter it;
+    EditorRow *row = rowstore_seek(&E.rows, E.rowoff, &it); // 从第一个可见行开始顺序访问
+    int state = editor_syntax_state_at(E.rowoff);           // 只从最近的检查点推进到第一个可见行
     for (y = 0; y < E.screen_rows; y++)
     {
         int filerow = y + E.rowoff; // 文件行位置 = 当前屏幕行数 + 已经隐藏的内容的行数
+        ab_reset(&line);
         if (filerow >= E.num_rows)
         {
             /* 没有文本内容输入时打印版本信息 */
@@ -659,72 +2118,99 @@ void editor_draw_rows(AppendBuffer *ab)
                 int padding = (E.screen_cols - welcomlen) / 2;
                 if (padding)
                 {
-                    ab_append(ab, "~", 1);
+                    ab_append(&line, "~", 1);
                     padding--;
                 }
                 while (padding--)
-                    ab_append(ab, " ", 1);
-                ab_append(ab, welcom, welcomlen);
+                    ab_append(&line, " ", 1);
+                ab_append(&line, welcom, welcomlen);
             }
             /* 有文本输入 */
             else
             {
-                ab_append(ab, "~", 1);
+                ab_append(&line, "~", 1);
             }
         }
         else
         {
-            int len = E.row[filerow].rsize - E.coloff; // 获取要打印的行的实际内容长度
+            if (editor_row_is_long(row))
+                editor_long_line_window(row, E.coloff, E.coloff + E.screen_cols);
+            editor_row_highlight(row, state);
+            state = row->hl_open_comment;
+            long first = E.coloff;            // 第一个显示的字节
+            long len = row->rsize - E.coloff; // 获取要打印的行的实际内容长度
+            if (!row->multibyte)
+            {
+                if (len > E.screen_cols)
+                    len = E.screen_cols;
+            }
+            else
+            {
+                /* render 的字节数与列数不同，按屏幕列找到可见部分的起止字节 */
+                first = editor_row_convert(row, E.coloff, ROW_RX, ROW_RB);
+                long rx = editor_row_convert(row, first, ROW_RB, ROW_RX);
+                if (first < row->rsize && rx < E.coloff)
+                {
+                    /* 宽字符被左边界截断，剩下的部分用空格代替 */
+                    int cp;
+                    first += utf8_decode(&row->render[first], row->rsize - first, &cp);
+                    for (rx += utf8_width(cp); rx > E.coloff; rx--)
+                        ab_append(&line, " ", 1);
+                }
+                long end = editor_row_convert(row, E.coloff + E.screen_cols, ROW_RX, ROW_RB);
+                len = (end < row->rsize ? end : row->rsize) - first;
+            }
             if (len < 0)
                 len = 0;
-            if (len > E.screen_cols)
-                len = E.screen_cols;
-            char *c = &E.row[filerow].render[E.coloff];
-            unsigned char *hl = &E.row[filerow].hl[E.coloff];
+            char *c = &row->render[first];
+            unsigned char *hl = &row->hl[first];
             int current_color = -1;
-            int j;
-            for (j = 0; j < len; j++)
+            int j = 0;
+            while (j < len)
             {
-                if (iscntrl(c[j]))
+                if (iscntrl((unsigned char)c[j]))
                 {
                     char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-                    ab_append(ab, "\x1b[7m", 4);
-                    ab_append(ab, &sym, 1);
-                    ab_append(ab, "\x1b[m", 3);
+                    ab_append(&line, "\x1b[7m", 4);
+                    ab_append(&line, &sym, 1);
+                    ab_append(&line, "\x1b[m", 3);
                     if (current_color != -1)
                     {
                         char buf[16];
                         int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-                        ab_append(ab, buf, clen);
+                        ab_append(&line, buf, clen);
                     }
+                    j++;
+                    continue;
                 }
-                else if (hl[j] == HL_NORMAL)
+
+                int color = (hl[j] == HL_NORMAL) ? -1 : editor_syntax_to_color(hl[j]);
+                if (color != current_color)
                 {
-                    if (current_color != -1)
+                    current_color = color;
+                    if (color == -1)
                     {
-
-                        ab_append(ab, "\x1b[39m", 5);
-                        current_color = -1;
+                        ab_append(&line, "\x1b[39m", 5);
                     }
-                    ab_append(ab, &c[j], 1);
-                }
-                else
-                {
-                    int color = editor_syntax_to_color(hl[j]);
-                    if (color != current_color)
+                    else
                     {
-                        current_color = color;
                         char buf[16];
                         int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-                        ab_append(ab, buf, clen);
+                        ab_append(&line, buf, clen);
                     }
-                    ab_append(ab, &c[j], 1);
                 }
+
+                /* 同一高亮类型的连续字符一次性添加，多字节字符不会被颜色切开 */
+                int start = j;
+                while (j < len && (hl[j] == hl[start] || (c[j] & 0xc0) == 0x80) && !iscntrl((unsigned char)c[j]))
+                    j++;
+                ab_append(&line, &c[start], j - start);
             }
-            ab_append(ab, "\x1b[39m", 5);
+            ab_append(&line, "\x1b[39m", 5);
+            row = rowstore_next(&it);
         }
-        ab_append(ab, "\x1b[K", 3); // 2K: 清除整行 1K: 清除光标左边 0K: 清除光标右边(默认)
-        ab_append(ab, "\r\n", 2);   // 换行
+        ab_append(&line, "\x1b[K", 3); // 2K: 清除整行 1K: 清除光标左边 0K: 清除光标右边(默认)
+        screen_put_line(&E.screen, ab, y, line.b, line.len);
     }
 }
 
@@ -736,8 +2222,13 @@ void editor_draw_status_bar(AppendBuffer *ab)
     int len = snprintf(status, sizeof(status), "%.20s - %d lines %s", E.filename ? E.filename : "[No Name]", E.num_rows,
                        E.dirty ? "(modified)" : "");
 
-    int rlen =
-        snprintf(rstatus, sizeof(rstatus), "%s | %d/%d", E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.num_rows);
+    int rlen;
+    if (E.matches.active)
+        rlen = snprintf(rstatus, sizeof(rstatus), "match %d/%ld | %s | %d/%d", E.matches.current + 1, E.matches.total,
+                        E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.num_rows);
+    else
+        rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d", E.syntax ? E.syntax->filetype : "no ft", E.cy + 1,
+                        E.num_rows);
 
     if (len > E.screen_cols)
         len = E.screen_cols;
@@ -758,7 +2249,6 @@ void editor_draw_status_bar(AppendBuffer *ab)
         }
     }
     ab_append(ab, "\x1b[m", 3); // 重置颜色配置
-    ab_append(ab, "\r\n", 2);   // 换行
 }
 
 /* 输出信息栏 */
@@ -767,10 +2257,14 @@ void editor_draw_message_bar(AppendBuffer *ab)
     ab_append(ab, "\x1b[K", 3); // 清除行内光标右边内容
     int msglen = strlen(E.statusmsg);
     if (msglen > E.screen_cols)
+    {
         msglen = E.screen_cols;
+        while (msglen > 0 && (E.statusmsg[msglen] & 0xc0) == 0x80)
+            msglen--; // 不截断多字节字符
+    }
 
     /* 5 秒更新一次状态信息 */
-    if (msglen && time(NULL) - E.statusmsg_time < 5)
+    if (msglen && (E.prompt_active || time(NULL) - E.statusmsg_time < MVIM_MSG_TIMEOUT))
         ab_append(ab, E.statusmsg, msglen);
 }
 
@@ -780,28 +2274,33 @@ void editor_refresh_screen()
     /* 处理滚动产生的 rowoff, coloff 和 rx 改变 */
     editor_scroll();
 
-    /* 定义一个打印信息结构体并初始化 */
-    AppendBuffer ab = ABUF_INIT;
+    /* 输出缓冲跨帧复用 */
+    static AppendBuffer ab = ABUF_INIT;
+    static AppendBuffer line = ABUF_INIT; // 状态栏和信息栏的内容，与上一帧比较后再输出
 
-    ab_append(&ab, "\x1b[H", 3);    // 光标位置设置为左上角
+    ab_reset(&ab);
     ab_append(&ab, "\x1b[?25l", 6); // 隐藏光标
 
+    /* 只输出与上一帧不同的行 */
     editor_draw_rows(&ab);
-    editor_draw_status_bar(&ab);
-    editor_draw_message_bar(&ab);
+
+    ab_reset(&line);
+    editor_draw_status_bar(&line);
+    screen_put_line(&E.screen, &ab, E.screen_rows, line.b, line.len);
+
+    ab_reset(&line);
+    editor_draw_message_bar(&line);
+    screen_put_line(&E.screen, &ab, E.screen_rows + 1, line.b, line.len);
 
     /* 设置光标位置为实际相对屏幕位置 */
-    char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1, (E.rx - E.coloff) + 1);
+    char buf[48];
+    snprintf(buf, sizeof(buf), "\x1b[%d;%ldH", (E.cy - E.rowoff) + 1, (E.rx - E.coloff) + 1);
     ab_append(&ab, buf, strlen(buf));
 
     ab_append(&ab, "\x1b[?25h", 6); // 显示光标
 
     /* 输出屏幕内容 */
     write(STDOUT_FILENO, ab.b, ab.len);
-
-    /* 释放资源 */
-    ab_free(&ab);
 }
 
 char *editor_prompt(char *prompt, void (*callback)(char *, int))
@@ -810,6 +2309,7 @@ char *editor_prompt(char *prompt, void (*callback)(char *, int))
     char *buf = malloc(bufsize);
     size_t buflen = 0;
     buf[0] = '\0';
+    E.prompt_active = 1; // 等待输入时提示信息不会过期
     while (1)
     {
         editor_set_status_message(prompt, buf);
@@ -822,6 +2322,7 @@ char *editor_prompt(char *prompt, void (*callback)(char *, int))
         }
         else if (c == '\x1b')
         {
+            E.prompt_active = 0;
             editor_set_status_message("");
             if (callback)
                 callback(buf, c);
@@ -832,12 +2333,29 @@ char *editor_prompt(char *prompt, void (*callback)(char *, int))
         {
             if (buflen != 0)
             {
+                E.prompt_active = 0;
                 editor_set_status_message("");
                 if (callback)
                     callback(buf, c);
                 return buf;
             }
         }
+        else if (c == PASTE_KEY)
+        {
+            /* 粘贴到提示框时只取第一行中的可打印字符 */
+            for (int i = 0; i < E.paste.len && E.paste.b[i] != '\r' && E.paste.b[i] != '\n'; i++)
+            {
+                if (iscntrl((unsigned char)E.paste.b[i]))
+                    continue;
+                if (buflen == bufsize - 1)
+                {
+                    bufsize *= 2;
+                    buf = realloc(buf, bufsize);
+                }
+                buf[buflen++] = E.paste.b[i];
+                buf[buflen] = '\0';
+            }
+        }
         else if (!iscntrl(c) && c < 128)
         {
             if (buflen == bufsize - 1)
@@ -856,20 +2374,20 @@ char *editor_prompt(char *prompt, void (*callback)(char *, int))
 /* 移动光标 */
 void editor_move_cursor(int key)
 {
-    EditorRow *row = (E.cy >= E.num_rows) ? NULL : &E.row[E.cy];
+    EditorRow *row = editor_row_at(E.cy);
 
     switch (key)
     {
     case ARROW_LEFT:
         if (E.cx != 0)
         {
-            E.cx--;
+            E.cx = editor_row_prev_char(row, E.cx);
         }
         /* 移动到上一行的末尾 */
         else if (E.cy > 0)
         {
             E.cy--;
-            E.cx = E.row[E.cy].size; // 光标所在列为当前光标所在行的内容的大小(最后一个字符的右边)
+            E.cx = editor_row_at(E.cy)->size; // 光标所在列为当前光标所在行的内容的大小(最后一个字符的右边)
         }
         break;
     case ARROW_DOWN:
@@ -881,7 +2399,7 @@ void editor_move_cursor(int key)
         /* 行内有内容并且光标所在列小于内容长度 */
         if (row && E.cx < row->size)
         {
-            E.cx++;
+            E.cx = editor_row_next_char(row, E.cx);
         }
         /* 移动到下一行开头 */
         else if (row && E.cx == row->size)
@@ -896,14 +2414,17 @@ void editor_move_cursor(int key)
         break;
     }
 
-    row = (E.cy >= E.num_rows) ? NULL : &E.row[E.cy]; // 获取当前行
-    int rowlen = row ? row->size : 0;                 // 获取当前行内容长度
+    row = editor_row_at(E.cy);        // 获取当前行
+    long rowlen = row ? row->size : 0;                // 获取当前行内容长度
 
     /* 限制光标往右移(没有字符的位置) */
     if (E.cx > rowlen)
     {
         E.cx = rowlen;
     }
+    /* 上下移动后不能停在多字节字符中间 */
+    if (row)
+        E.cx = editor_row_char_start(row, E.cx);
 }
 
 /* 处理按键事件 */
@@ -922,6 +2443,7 @@ void editor_process_keypress()
 
         /* ctrl + q 退出 */
     case CTRL_KEY('q'):
+        editor_save_collect(); // 等待后台保存完成
         if (E.dirty && quit_times > 0)
         {
             editor_set_status_message("WARNING!!! File has unsaved changes. "
@@ -930,6 +2452,7 @@ void editor_process_keypress()
             quit_times--;
             return;
         }
+        journal_close(&E.journal, 1);
         write(STDOUT_FILENO, "\x1b[2J", 4); // 清空屏幕
         write(STDOUT_FILENO, "\x1b[H", 3);  // 设置光标到左上角
         exit(0);
@@ -940,16 +2463,32 @@ void editor_process_keypress()
         break;
 
     case HOME_KEY:
+        undo_seal(&E.undo);
         E.cx = 0; // 光标设置到第一列
         break;
 
     case END_KEY:
+        undo_seal(&E.undo);
         if (E.cy < E.num_rows)
-            E.cx = E.row[E.cy].size;
+            E.cx = editor_row_at(E.cy)->size;
         break;
 
     case CTRL_KEY('f'):
-        editor_find();
+        undo_seal(&E.undo);
+        editor_find(0);
+        break;
+
+    case CTRL_KEY('r'):
+        undo_seal(&E.undo);
+        editor_find(1);
+        break;
+
+    case CTRL_KEY('z'):
+        editor_undo();
+        break;
+
+    case CTRL_KEY('y'):
+        editor_redo();
         break;
 
     case BACKSPACE:
@@ -962,6 +2501,7 @@ void editor_process_keypress()
 
     case PAGE_UP:
     case PAGE_DOWN: {
+        undo_seal(&E.undo);
         /* 往上翻页 */
         if (c == PAGE_UP)
         {
@@ -990,11 +2530,18 @@ void editor_process_keypress()
     case ARROW_RIGHT: // C
     case ARROW_UP:    // A
     case ARROW_DOWN:  // B
+        undo_seal(&E.undo);
         editor_move_cursor(c);
         break;
 
+    case PASTE_KEY:
+        if (E.paste.len > 0)
+            editor_insert_text(E.paste.b, E.paste.len, 1);
+        break;
+
     case CTRL_KEY('l'):
     case '\x1b':
+        undo_seal(&E.undo);
         break;
 
     default:
@@ -1004,16 +2551,13 @@ void editor_process_keypress()
     quit_times = MVIM_QUIT_TIMES;
 }
 
-void editor_update_syntax(EditorRow *row)
+/*
+ * 从 text 的 i 处开始做词法分析直到 end，state 为 i 处的状态(LEX_*)，返回时更新为停下处的状态。
+ * 跨过 end 的记号(转义、注释分界符、关键字)会整体处理，所以返回的位置可能大于 end。
+ * len 为 text 的总长度，用于向后查看。hl 为 NULL 时只跟踪注释和字符串，不生成高亮。
+ */
+long editor_syntax_lex_range(const char *text, long i, long end, long len, unsigned char *hl, int *state)
 {
-    row->hl = realloc(row->hl, row->rsize);
-    memset(row->hl, HL_NORMAL, row->rsize);
-
-    if (E.syntax == NULL)
-        return;
-
-    char **keywords = E.syntax->keywords;
-
     char *scs = E.syntax->singleline_comment_start;
     char *mcs = E.syntax->multiline_comment_start;
     char *mce = E.syntax->multiline_comment_end;
@@ -1022,22 +2566,30 @@ void editor_update_syntax(EditorRow *row)
     int mcs_len = mcs ? strlen(mcs) : 0;
     int mce_len = mce ? strlen(mce) : 0;
 
-    int prev_sep = 1;
-    int in_string = 0;
-    int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
+    int prev_sep = !(*state & LEX_NOT_SEP);
+    int in_comment = *state & LEX_IN_COMMENT;
+    int in_string = *state >> LEX_STRING_SHIFT;
+
+    /* 单行注释一直到行尾 */
+    if (*state & LEX_LINE_COMMENT)
+    {
+        if (hl && i < end)
+            memset(&hl[i], HL_COMMENT, end - i);
+        return i < end ? end : i;
+    }
 
-    int i = 0;
-    while (i < row->rsize)
+    while (i < end)
     {
-        char c = row->render[i];
-        unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+        char c = text[i];
 
         if (scs_len && !in_string && !in_comment)
         {
-            if (!strncmp(&row->render[i], scs, scs_len))
+            if (len - i >= scs_len && !memcmp(&text[i], scs, scs_len))
             {
-                memset(&row->hl[i], HL_COMMENT, row->rsize - i);
-                break;
+                if (hl)
+                    memset(&hl[i], HL_COMMENT, end - i);
+                *state = LEX_LINE_COMMENT;
+                return end;
             }
         }
 
@@ -1045,10 +2597,12 @@ void editor_update_syntax(EditorRow *row)
         {
             if (in_comment)
             {
-                row->hl[i] = HL_MLCOMMENT;
-                if (!strncmp(&row->render[i], mce, mce_len))
+                if (hl)
+                    hl[i] = HL_MLCOMMENT;
+                if (len - i >= mce_len && !memcmp(&text[i], mce, mce_len))
                 {
-                    memset(&row->hl[i], HL_MLCOMMENT, mce_len);
+                    if (hl)
+                        memset(&hl[i], HL_MLCOMMENT, mce_len);
                     i += mce_len;
                     in_comment = 0;
                     prev_sep = 1;
@@ -1060,9 +2614,10 @@ void editor_update_syntax(EditorRow *row)
                     continue;
                 }
             }
-            else if (!strncmp(&row->render[i], mcs, mcs_len))
+            else if (len - i >= mcs_len && !memcmp(&text[i], mcs, mcs_len))
             {
-                memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
+                if (hl)
+                    memset(&hl[i], HL_MLCOMMENT, mcs_len);
                 i += mcs_len;
                 in_comment = 1;
                 continue;
@@ -1073,10 +2628,12 @@ void editor_update_syntax(EditorRow *row)
         {
             if (in_string)
             {
-                row->hl[i] = HL_STRING;
-                if (c == '\\' && i + 1 < row->rsize)
+                if (hl)
+                    hl[i] = HL_STRING;
+                if (c == '\\' && i + 1 < len)
                 {
-                    row->hl[i + 1] = HL_STRING;
+                    if (hl)
+                        hl[i + 1] = HL_STRING;
                     i += 2;
                     continue;
                 }
@@ -1091,19 +2648,29 @@ void editor_update_syntax(EditorRow *row)
                 if (c == '"' || c == '\'')
                 {
                     in_string = c;
-                    row->hl[i] = HL_STRING;
+                    if (hl)
+                        hl[i] = HL_STRING;
                     i++;
                     continue;
                 }
             }
         }
 
+        /* 数字和关键字不影响跨行状态，只计算状态时跳过 */
+        if (hl == NULL)
+        {
+            i++;
+            continue;
+        }
+
+        unsigned char prev_hl = (i > 0) ? hl[i - 1] : HL_NORMAL;
+
         if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS)
         {
-            if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) || ((c == '.') && (prev_hl == HL_NUMBER)))
+            if ((isdigit((unsigned char)c) && (prev_sep || prev_hl == HL_NUMBER)) || ((c == '.') && (prev_hl == HL_NUMBER)))
             {
 
-                row->hl[i] = HL_NUMBER;
+                hl[i] = HL_NUMBER;
                 i++;
                 prev_sep = 0;
                 continue;
@@ -1112,22 +2679,17 @@ void editor_update_syntax(EditorRow *row)
 
         if (prev_sep)
         {
-            int j;
-            for (j = 0; keywords[j]; j++)
-            {
-                int klen = strlen(keywords[j]);
-                int kw2 = keywords[j][klen - 1] == '|';
-                if (kw2)
-                    klen--;
-                if (!strncmp(&row->render[i], keywords[j], klen) && is_separator(row->render[i + klen]))
-                {
-                    memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-                    i += klen;
-                    break;
-                }
-            }
-            if (keywords[j] != NULL)
+            /* 取出到下一个分隔符为止的单词，超过最长关键字时不必继续 */
+            KeywordTable *kt = &E.syntax->kwtable;
+            int klen = 0;
+            while (i + klen < len && klen <= kt->max_len && !is_separator(text[i + klen]))
+                klen++;
+
+            int kind = keyword_table_lookup(kt, &text[i], klen);
+            if (kind)
             {
+                memset(&hl[i], kind == 2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
+                i += klen;
                 prev_sep = 0;
                 continue;
             }
@@ -1135,11 +2697,103 @@ void editor_update_syntax(EditorRow *row)
         prev_sep = is_separator(c);
         i++;
     }
+    *state = in_comment | in_string << LEX_STRING_SHIFT | (hl && !prev_sep ? LEX_NOT_SEP : 0);
+    return i;
+}
+
+/* 对一行文本做词法分析，in_comment 为行首的多行注释状态，返回行尾的状态 */
+static int editor_syntax_lex(const char *text, long len, unsigned char *hl, int in_comment)
+{
+    int state = in_comment;
+    editor_syntax_lex_range(text, 0, len, len, hl, &state);
+    return state & LEX_IN_COMMENT;
+}
+
+/* 以 row->hl_state_in 为行首状态高亮一行，不再递归更新后续行 */
+void editor_update_syntax(EditorRow *row)
+{
+    row->hl = (unsigned char *)row->render + row->rsize + 1; // 紧接在 render 之后
+    memset(row->hl, HL_NORMAL, row->rsize);
+    row->hl_epoch = E.hl_epoch;
+
+    if (E.syntax == NULL)
+    {
+        row->hl_open_comment = 0;
+        return;
+    }
+
+    if (row->ll)
+    {
+        /* 长行从窗口起点所在块记录的状态开始分析，行尾状态取自块索引 */
+        LongLine *ll = row->ll;
+        editor_long_line_lex(row, row->hl_state_in);
+        LineChunk *c = &ll->chunks[editor_long_line_find(ll, ll->win_cx, ROW_CX)];
+        int state = c->lex_state;
+        long i = editor_row_convert(row, c->lex_cx, ROW_CX, ROW_RB);
+        editor_syntax_lex_range(row->render, i, row->rsize, row->rsize, row->hl, &state);
+        row->hl_open_comment = ll->lex_out;
+        return;
+    }
+    row->hl_open_comment = editor_syntax_lex(row->render, row->rsize, row->hl, row->hl_state_in);
+}
+
+/* 从 at 行开始的检查点失效，at 行之前的状态不受影响 */
+void editor_syntax_invalidate(int at)
+{
+    int valid = (at < 0 ? 0 : at) / MVIM_HL_CHECKPOINT_LINES + 1;
+    if (E.hl_cp_valid > valid)
+        E.hl_cp_valid = valid;
+}
+
+/* 第 at 行行首的多行注释状态：从最近的检查点开始只做状态分析 */
+int editor_syntax_state_at(int at)
+{
+    if (E.syntax == NULL || at <= 0)
+        return 0;
+
+    int k = at / MVIM_HL_CHECKPOINT_LINES;
+    if (E.hl_cp_valid == 0)
+    {
+        E.hl_cp_valid = 1;
+        if (E.hl_cp_cap == 0)
+        {
+            E.hl_cp_cap = 64;
+            E.hl_cp = malloc(E.hl_cp_cap);
+            if (E.hl_cp == NULL)
+                die("malloc");
+        }
+        E.hl_cp[0] = 0;
+    }
 
-    int changed = (row->hl_open_comment != in_comment);
-    row->hl_open_comment = in_comment;
-    if (changed && row->idx + 1 < E.num_rows)
-        editor_update_syntax(&E.row[row->idx + 1]);
+    /* 检查点不够时向后推进，每 MVIM_HL_CHECKPOINT_LINES 行保存一次状态 */
+    int line = (k < E.hl_cp_valid ? k : E.hl_cp_valid - 1) * MVIM_HL_CHECKPOINT_LINES;
+    int state = E.hl_cp[line / MVIM_HL_CHECKPOINT_LINES];
+    RowIter it;
+    EditorRow *row = rowstore_seek(&E.rows, line, &it);
+    for (; row && line < at; row = rowstore_next(&it))
+    {
+        if (editor_row_is_long(row))
+            state = editor_long_line_state_out(row, state);
+        else
+        {
+            editor_row_flatten(row, row->size);
+            state = editor_syntax_lex(row->chars, row->size, NULL, state);
+        }
+        line++;
+
+        if (line % MVIM_HL_CHECKPOINT_LINES == 0 && line / MVIM_HL_CHECKPOINT_LINES == E.hl_cp_valid)
+        {
+            if (E.hl_cp_valid == E.hl_cp_cap)
+            {
+                E.hl_cp_cap *= 2;
+                E.hl_cp = realloc(E.hl_cp, E.hl_cp_cap);
+                if (E.hl_cp == NULL)
+                    die("realloc");
+            }
+            E.hl_cp[E.hl_cp_valid++] = state;
+        }
+    }
+    return state;
 }
 
 int editor_syntax_to_color(int hl)
@@ -1166,7 +2820,10 @@ int editor_syntax_to_color(int hl)
 
 void editor_select_syntax_highlight()
 {
+    if (E.syntax)
+        E.hl_epoch++;
     E.syntax = NULL;
+    E.hl_cp_valid = 0;
     if (E.filename == NULL)
         return;
 
@@ -1182,12 +2839,7 @@ void editor_select_syntax_highlight()
             if ((is_ext && ext && !strcmp(ext, s->filematch[i])) || (!is_ext && strstr(E.filename, s->filematch[i])))
             {
                 E.syntax = s;
-                int filerow;
-                for (filerow = 0; filerow < E.num_rows; filerow++)
-                {
-                    editor_update_syntax(&E.row[filerow]);
-                }
-
+                E.hl_epoch++; // 所有行的高亮在显示时重新计算
                 return;
             }
             i++;
@@ -1195,9 +2847,28 @@ void editor_select_syntax_highlight()
     }
 }
 
+/* 启动时把每种语法的关键字列表编译成哈希表 */
+void editor_syntax_compile()
+{
+    for (unsigned int j = 0; j < HLDB_ENTRIES; j++)
+        keyword_table_build(&HLDB[j].kwtable, HLDB[j].keywords);
+}
+
 int is_separator(int c)
 {
-    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+    return isspace((unsigned char)c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+}
+
+/* 退出时把行内存分配器的统计追加到 MVIM_ALLOC_STATS 指定的文件 */
+static void editor_alloc_stats()
+{
+    FILE *fp = fopen(getenv(MVIM_ALLOC_STATS), "a");
+    if (fp == NULL)
+        return;
+    char buf[512];
+    row_alloc_format(&E.alloc, buf, sizeof(buf));
+    fprintf(fp, "%s\n", buf);
+    fclose(fp);
 }
 
 /* 初始化 */
@@ -1209,29 +2880,82 @@ void init_editor()
     E.rowoff = 0;
     E.coloff = 0;
     E.num_rows = 0;
-    E.row = NULL;
+    E.rows.root = NULL;
+    E.alloc = (RowAlloc)ROW_ALLOC_INIT;
+    E.gap.row = NULL;
+    if (getenv(MVIM_ALLOC_STATS))
+        atexit(editor_alloc_stats);
     E.dirty = 0;
     E.filename = NULL;
+    E.map = NULL;
+    E.map_len = 0;
     E.statusmsg[0] = '\0';
     E.statusmsg_time = 0;
     E.syntax = NULL;
+    E.hl_epoch = 1;
+    editor_syntax_compile();
+    utf8_init();
+    E.hl_cp = NULL;
+    E.hl_cp_valid = 0;
+    E.hl_cp_cap = 0;
+    E.lru_head = NULL;
+    E.lru_tail = NULL;
+    E.cache_bytes = 0;
+    E.cache_budget = MVIM_CACHE_BUDGET;
+
+    char *budget = getenv("MVIM_CACHE_BUDGET");
+    if (budget && atol(budget) > 0)
+        E.cache_budget = atol(budget);
+
+    E.long_line = MVIM_LONG_LINE;
+    char *long_line = getenv("MVIM_LONG_LINE");
+    if (long_line && atol(long_line) > 0)
+        E.long_line = atol(long_line);
+
+    E.prompt_active = 0;
+    E.search_regex = 0;
+    E.matches = (MatchIndex)MATCH_INDEX_INIT;
+    E.signal_fd = -1;
+    E.undo = (UndoLog)UNDO_LOG_INIT;
+    E.undo.budget = MVIM_UNDO_BUDGET;
+
+    char *undo_budget = getenv("MVIM_UNDO_BUDGET");
+    if (undo_budget && atol(undo_budget) > 0)
+        E.undo.budget = atol(undo_budget);
+
+    E.save_pid = -1;
+    E.save_fd = -1;
+    E.save_dirty = 0;
+    E.journal = (Journal)JOURNAL_INIT;
+    E.save_journal_off = -1;
+
+    editor_update_window_size();
+}
 
+/* 获取屏幕大小，终端上的内容需要全部重绘 */
+void editor_update_window_size()
+{
     if (get_window_size(&E.screen_rows, &E.screen_cols) == -1)
         die("get_window_size");
 
+    screen_resize(&E.screen, E.screen_rows, E.screen_cols);
     E.screen_rows -= 2; // 预留状态栏合信息栏
+    if (E.screen_rows < 1)
+        E.screen_rows = 1;
 }
 
 int main(int argc, char *argv[])
 {
     enable_raw_mode(); // 开启原始输入模式
     init_editor();
+    editor_init_events();
     if (argc >= 2)
     {
         editor_open(argv[1]);
     }
 
-    editor_set_status_message("帮助: Ctrl-S = 保存 | Ctrl-Q = 退出 | Ctrl-F = 搜索");
+    if (E.statusmsg[0] == '\0') // 打开文件时的提示(例如恢复日志的状态)优先显示
+        editor_set_status_message("帮助: Ctrl-S = 保存 | Ctrl-Q = 退出 | Ctrl-F = 搜索 | Ctrl-R = 正则");
 
     /* 循环地接收按键并处理，然后刷新内容 */
     while (1)
@@ -0,0 +1,966 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "./include/regexp.h"
+#include "./include/utils.h"
+
+#define REGEXP_MAX_NODES 65536    // NFA 最多节点数，防止 {m,n} 展开后过大
+#define REGEXP_MAX_REPEAT 1000    // {m,n} 中允许的最大次数
+#define DFA_MAX_STATES 2048       // 每个 DFA 最多缓存的状态数，用完后清空重新构造
+#define DFA_HASH_SIZE (DFA_MAX_STATES * 2)
+#define REGEXP_MAX_PREFIX 64      // 字面前缀最大长度
+
+/* 语法树节点 */
+enum AstType
+{
+    AST_CHAR,   // 字符集合
+    AST_BOL,    // ^
+    AST_EOL,    // $
+    AST_EMPTY,  // 空表达式
+    AST_CAT,    // 连接
+    AST_ALT,    // |
+    AST_REPEAT  // * + ? {m,n}
+};
+
+typedef struct AstNode
+{
+    int type;
+    int set;         // AST_CHAR 的字符集合
+    int left, right; // 子节点，AST_REPEAT 只用 left
+    int min, max;    // 重复次数，max 为 -1 表示不限
+} AstNode;
+
+/* NFA 节点 */
+enum NfaType
+{
+    NFA_CHAR,  // 读入一个属于集合的字节后转到 out
+    NFA_SPLIT, // 同时转到 out 和 out1
+    NFA_BOL,   // 在行首时转到 out
+    NFA_EOL,   // 在行尾时转到 out
+    NFA_MATCH  // 匹配成功
+};
+
+typedef struct NfaNode
+{
+    int type;
+    int set;
+    int out, out1;
+} NfaNode;
+
+typedef struct Nfa
+{
+    NfaNode *nodes;
+    int n, cap;
+    int start;
+    int overflow; // 节点数超过上限
+} Nfa;
+
+#define DFA_ACCEPT 1      // 状态中包含 NFA_MATCH
+#define DFA_EOL_KNOWN 2   // 已计算在行尾是否匹配，空行(同时在行首)时左移两位
+#define DFA_EOL_ACCEPT 4  // 在行尾时匹配
+
+/* 按需构造的 DFA，状态是 NFA 节点集合 */
+typedef struct Dfa
+{
+    struct Regexp *re;
+    Nfa *nfa;
+    int unanchored;        // 每个位置都可以开始新的匹配
+    int scan;              // 用于快速扫描：到匹配状态和换行、回车的转移不缓存，扫描循环只需要查表
+    int num_states;
+    int *set_off, *set_len; // 每个状态的 NFA 节点集合在 pool 中的位置
+    int *pool;
+    int pool_len, pool_cap;
+    unsigned char *flags;
+    int *trans;            // 状态转移表，保存下一个状态乘以类别数(即它在表中的行偏移)，-1 表示还没有计算
+    int *hash;             // NFA 节点集合到状态的哈希表
+    int start[2];          // 不在行首/在行首的起始状态，-1 表示还没有构造
+    int flushes;           // 清空缓存的次数
+    int *mark;             // 求闭包时标记已访问的节点
+    int gen;
+    int *stack;
+    int *tmp;              // 正在构造的节点集合
+    int tmp_n;
+} Dfa;
+
+struct Regexp
+{
+    unsigned char (*sets)[32]; // 字符集合位图
+    int num_sets, sets_cap;
+    AstNode *ast;
+    int ast_n, ast_cap;
+    unsigned char byte_class[256]; // 行为相同的字节归为一类，转移表按类索引
+    unsigned char class_byte[256]; // 每一类的代表字节
+    int num_classes;
+    int nl_class, cr_class;
+    char prefix[REGEXP_MAX_PREFIX]; // 所有匹配都以它开头的字面字符串，用于快速跳过不可能匹配的行
+    int prefix_len;
+    Nfa fwd, rev;
+    Dfa search;   // 正向、非锚定：找到第一个包含匹配的行
+    Dfa backward; // 反向、非锚定：找到行内最靠左的匹配起点
+    Dfa anchored; // 正向、锚定：从起点找最长的匹配
+};
+
+/* ---------- 解析 ---------- */
+
+typedef struct Parser
+{
+    Regexp *re;
+    const char *s;
+    int error;
+} Parser;
+
+static int ast_new(Regexp *re, int type, int left, int right)
+{
+    if (re->ast_n == re->ast_cap)
+    {
+        re->ast_cap = re->ast_cap ? re->ast_cap * 2 : 32;
+        re->ast = realloc(re->ast, sizeof(AstNode) * re->ast_cap);
+        if (re->ast == NULL)
+            die("realloc");
+    }
+    AstNode *node = &re->ast[re->ast_n];
+    node->type = type;
+    node->set = -1;
+    node->left = left;
+    node->right = right;
+    node->min = node->max = 0;
+    return re->ast_n++;
+}
+
+static int set_new(Regexp *re)
+{
+    if (re->num_sets == re->sets_cap)
+    {
+        re->sets_cap = re->sets_cap ? re->sets_cap * 2 : 16;
+        re->sets = realloc(re->sets, 32 * re->sets_cap);
+        if (re->sets == NULL)
+            die("realloc");
+    }
+    memset(re->sets[re->num_sets], 0, 32);
+    return re->num_sets++;
+}
+
+static void set_add(unsigned char *set, int c)
+{
+    set[c >> 3] |= 1 << (c & 7);
+}
+
+static int set_has(const unsigned char *set, int c)
+{
+    return set[c >> 3] & (1 << (c & 7));
+}
+
+/* 取反，换行符永远不属于任何集合 */
+static void set_negate(unsigned char *set)
+{
+    for (int i = 0; i < 32; i++)
+        set[i] = ~set[i];
+    set['\n' >> 3] &= ~(1 << ('\n' & 7));
+}
+
+/* \d \w \s 及其大写形式，不是字符类返回 0 */
+static int set_add_escape_class(unsigned char *set, int e)
+{
+    unsigned char cls[32];
+    memset(cls, 0, sizeof(cls));
+    switch (e | 0x20)
+    {
+    case 'd':
+        for (int c = '0'; c <= '9'; c++)
+            set_add(cls, c);
+        break;
+    case 'w':
+        for (int c = 0; c < 128; c++)
+            if ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_')
+                set_add(cls, c);
+        break;
+    case 's':
+        set_add(cls, ' ');
+        set_add(cls, '\t');
+        set_add(cls, '\r');
+        set_add(cls, '\f');
+        set_add(cls, '\v');
+        break;
+    default:
+        return 0;
+    }
+    if (e >= 'A' && e <= 'Z')
+        set_negate(cls);
+    for (int i = 0; i < 32; i++)
+        set[i] |= cls[i];
+    return 1;
+}
+
+/* 转义后的普通字符 */
+static int escape_char(int e)
+{
+    switch (e)
+    {
+    case 't':
+        return '\t';
+    case 'n':
+        return '\n';
+    case 'r':
+        return '\r';
+    default:
+        return e;
+    }
+}
+
+static int parse_alt(Parser *p);
+
+/* [...] 字符集合 */
+static int parse_class(Parser *p)
+{
+    Regexp *re = p->re;
+    int set = set_new(re);
+    int negate = 0;
+
+    if (*p->s == '^')
+    {
+        negate = 1;
+        p->s++;
+    }
+    int first = 1;
+    while (*p->s && (*p->s != ']' || first))
+    {
+        first = 0;
+        int lo = (unsigned char)*p->s++;
+        if (lo == '\\')
+        {
+            if (*p->s == '\0')
+                break;
+            int e = (unsigned char)*p->s++;
+            if (set_add_escape_class(re->sets[set], e))
+                continue;
+            lo = escape_char(e);
+        }
+
+        int hi = lo;
+        if (p->s[0] == '-' && p->s[1] && p->s[1] != ']')
+        {
+            p->s++;
+            hi = (unsigned char)*p->s++;
+            if (hi == '\\' && *p->s)
+                hi = escape_char((unsigned char)*p->s++);
+            if (hi < lo)
+            {
+                p->error = 1;
+                return -1;
+            }
+        }
+        for (int c = lo; c <= hi; c++)
+            set_add(re->sets[set], c);
+    }
+    if (*p->s != ']')
+    {
+        p->error = 1;
+        return -1;
+    }
+    p->s++;
+
+    if (negate)
+        set_negate(re->sets[set]);
+    int node = ast_new(re, AST_CHAR, -1, -1);
+    re->ast[node].set = set;
+    return node;
+}
+
+static int parse_atom(Parser *p)
+{
+    Regexp *re = p->re;
+    int c = (unsigned char)*p->s++;
+    int node;
+
+    switch (c)
+    {
+    case '(':
+        node = parse_alt(p);
+        if (p->error || *p->s != ')')
+        {
+            p->error = 1;
+            return -1;
+        }
+        p->s++;
+        return node;
+    case '[':
+        return parse_class(p);
+    case '^':
+        return ast_new(re, AST_BOL, -1, -1);
+    case '$':
+        return ast_new(re, AST_EOL, -1, -1);
+    case '*':
+    case '+':
+    case '?':
+        p->error = 1; // 重复符号前面没有内容
+        return -1;
+    }
+
+    int set = set_new(re);
+    if (c == '.')
+    {
+        set_negate(re->sets[set]);
+    }
+    else if (c == '\\')
+    {
+        if (*p->s == '\0')
+        {
+            p->error = 1;
+            return -1;
+        }
+        int e = (unsigned char)*p->s++;
+        if (!set_add_escape_class(re->sets[set], e))
+            set_add(re->sets[set], escape_char(e));
+    }
+    else
+    {
+        set_add(re->sets[set], c);
+    }
+    node = ast_new(re, AST_CHAR, -1, -1);
+    re->ast[node].set = set;
+    return node;
+}
+
+/* 解析 {m} {m,} {m,n}，格式不对时返回 0，'{' 按普通字符处理 */
+static int parse_braces(Parser *p, int *min, int *max)
+{
+    const char *s = p->s + 1;
+    if (*s < '0' || *s > '9')
+        return 0;
+    *min = 0;
+    for (; *s >= '0' && *s <= '9'; s++)
+        if (*min <= REGEXP_MAX_REPEAT)
+            *min = *min * 10 + (*s - '0');
+    *max = *min;
+    if (*s == ',')
+    {
+        s++;
+        *max = -1;
+        if (*s >= '0' && *s <= '9')
+        {
+            *max = 0;
+            for (; *s >= '0' && *s <= '9'; s++)
+                if (*max <= REGEXP_MAX_REPEAT)
+                    *max = *max * 10 + (*s - '0');
+        }
+    }
+    if (*s != '}')
+        return 0;
+    p->s = s + 1;
+    return 1;
+}
+
+static int parse_repeat(Parser *p)
+{
+    int node = parse_atom(p);
+    while (!p->error)
+    {
+        int min, max;
+        char c = *p->s;
+        if (c == '*' || c == '+' || c == '?')
+        {
+            p->s++;
+            min = c == '+';
+            max = c == '?' ? 1 : -1;
+        }
+        else if (c != '{' || !parse_braces(p, &min, &max))
+        {
+            break;
+        }
+        else if (min > REGEXP_MAX_REPEAT || max > REGEXP_MAX_REPEAT || (max != -1 && max < min))
+        {
+            p->error = 1;
+            break;
+        }
+        int rep = ast_new(p->re, AST_REPEAT, node, -1);
+        p->re->ast[rep].min = min;
+        p->re->ast[rep].max = max;
+        node = rep;
+    }
+    return node;
+}
+
+static int parse_cat(Parser *p)
+{
+    int node = -1;
+    while (*p->s && *p->s != '|' && *p->s != ')' && !p->error)
+    {
+        int next = parse_repeat(p);
+        node = node == -1 ? next : ast_new(p->re, AST_CAT, node, next);
+    }
+    if (node == -1)
+        node = ast_new(p->re, AST_EMPTY, -1, -1);
+    return node;
+}
+
+static int parse_alt(Parser *p)
+{
+    int node = parse_cat(p);
+    while (*p->s == '|' && !p->error)
+    {
+        p->s++;
+        int right = parse_cat(p);
+        node = ast_new(p->re, AST_ALT, node, right);
+    }
+    return node;
+}
+
+/* ---------- 编译成 NFA ---------- */
+
+static int nfa_new(Nfa *nfa, int type, int set, int out, int out1)
+{
+    if (nfa->n == REGEXP_MAX_NODES)
+    {
+        nfa->overflow = 1;
+        return 0;
+    }
+    if (nfa->n == nfa->cap)
+    {
+        nfa->cap = nfa->cap ? nfa->cap * 2 : 64;
+        nfa->nodes = realloc(nfa->nodes, sizeof(NfaNode) * nfa->cap);
+        if (nfa->nodes == NULL)
+            die("realloc");
+    }
+    NfaNode *node = &nfa->nodes[nfa->n];
+    node->type = type;
+    node->set = set;
+    node->out = out;
+    node->out1 = out1;
+    return nfa->n++;
+}
+
+/* 编译语法树节点，匹配完成后转到 next，返回入口节点。reverse 表示编译成从右向左匹配的 NFA */
+static int nfa_compile(Regexp *re, Nfa *nfa, int ast, int next, int reverse)
+{
+    AstNode node = re->ast[ast];
+    int cur, s;
+
+    if (nfa->overflow)
+        return 0;
+    switch (node.type)
+    {
+    case AST_CHAR:
+        return nfa_new(nfa, NFA_CHAR, node.set, next, -1);
+    case AST_BOL:
+        return nfa_new(nfa, reverse ? NFA_EOL : NFA_BOL, -1, next, -1);
+    case AST_EOL:
+        return nfa_new(nfa, reverse ? NFA_BOL : NFA_EOL, -1, next, -1);
+    case AST_CAT:
+        /* 反向匹配时先匹配右边的部分 */
+        if (reverse)
+            return nfa_compile(re, nfa, node.right, nfa_compile(re, nfa, node.left, next, reverse), reverse);
+        return nfa_compile(re, nfa, node.left, nfa_compile(re, nfa, node.right, next, reverse), reverse);
+    case AST_ALT:
+        cur = nfa_compile(re, nfa, node.left, next, reverse);
+        return nfa_new(nfa, NFA_SPLIT, -1, cur, nfa_compile(re, nfa, node.right, next, reverse));
+    case AST_REPEAT:
+        cur = next;
+        if (node.max == -1)
+        {
+            /* 不限次数：循环 */
+            s = nfa_new(nfa, NFA_SPLIT, -1, -1, cur);
+            int body = nfa_compile(re, nfa, node.left, s, reverse);
+            if (!nfa->overflow)
+                nfa->nodes[s].out = body;
+            cur = s;
+        }
+        else
+        {
+            /* 可选的部分：max - min 个嵌套的 (x)? */
+            for (int i = node.min; i < node.max && !nfa->overflow; i++)
+                cur = nfa_new(nfa, NFA_SPLIT, -1, nfa_compile(re, nfa, node.left, cur, reverse), cur);
+        }
+        for (int i = 0; i < node.min && !nfa->overflow; i++)
+            cur = nfa_compile(re, nfa, node.left, cur, reverse);
+        return cur;
+    default:
+        return next;
+    }
+}
+
+/* 把 256 个字节按照在所有字符集合中的归属划分成等价类，换行和回车单独成类 */
+static void regexp_byte_classes(Regexp *re)
+{
+    unsigned char cls[256];
+    int map[512];
+    int n = 3;
+
+    memset(cls, 0, sizeof(cls));
+    cls['\n'] = 1;
+    cls['\r'] = 2;
+    for (int i = 0; i < re->num_sets; i++)
+    {
+        for (int k = 0; k < 2 * n; k++)
+            map[k] = -1;
+        int m = 0;
+        for (int b = 0; b < 256; b++)
+        {
+            int key = cls[b] * 2 + !!set_has(re->sets[i], b);
+            if (map[key] == -1)
+                map[key] = m++;
+            cls[b] = map[key];
+        }
+        n = m;
+    }
+
+    memcpy(re->byte_class, cls, sizeof(cls));
+    re->num_classes = n;
+    for (int b = 255; b >= 0; b--)
+        re->class_byte[cls[b]] = b;
+    re->nl_class = cls['\n'];
+    re->cr_class = cls['\r'];
+}
+
+/* 收集表达式开头的单个字符，返回是否可以继续向后收集 */
+static int regexp_prefix(Regexp *re, int ast)
+{
+    AstNode *node = &re->ast[ast];
+    switch (node->type)
+    {
+    case AST_BOL:
+        return 1;
+    case AST_CAT:
+        return regexp_prefix(re, node->left) && regexp_prefix(re, node->right);
+    case AST_CHAR:
+    {
+        int c = -1;
+        for (int b = 0; b < 256; b++)
+        {
+            if (!set_has(re->sets[node->set], b))
+                continue;
+            if (c != -1)
+                return 0; // 不止一个字符
+            c = b;
+        }
+        if (c == -1 || re->prefix_len == REGEXP_MAX_PREFIX)
+            return 0;
+        re->prefix[re->prefix_len++] = c;
+        return 1;
+    }
+    default:
+        return 0;
+    }
+}
+
+/* ---------- DFA ---------- */
+
+static void dfa_flush(Dfa *d)
+{
+    d->num_states = 0;
+    d->pool_len = 0;
+    for (int i = 0; i < DFA_HASH_SIZE; i++)
+        d->hash[i] = -1;
+    d->start[0] = d->start[1] = -1;
+    d->flushes++;
+}
+
+static void dfa_init(Dfa *d, Regexp *re, Nfa *nfa, int unanchored, int scan)
+{
+    d->re = re;
+    d->nfa = nfa;
+    d->unanchored = unanchored;
+    d->scan = scan;
+    d->set_off = malloc(sizeof(int) * DFA_MAX_STATES);
+    d->set_len = malloc(sizeof(int) * DFA_MAX_STATES);
+    d->flags = malloc(DFA_MAX_STATES);
+    d->trans = malloc(sizeof(int) * DFA_MAX_STATES * re->num_classes);
+    d->hash = malloc(sizeof(int) * DFA_HASH_SIZE);
+    d->mark = calloc(nfa->n, sizeof(int));
+    d->stack = malloc(sizeof(int) * (nfa->n * 2 + 1)); // 每个节点最多压入两个后继
+    d->tmp = malloc(sizeof(int) * nfa->n);
+    d->pool = NULL;
+    d->pool_cap = 0;
+    d->gen = 0;
+    if (!d->set_off || !d->set_len || !d->flags || !d->trans || !d->hash || !d->mark || !d->stack || !d->tmp)
+        die("malloc");
+    dfa_flush(d);
+}
+
+static void dfa_free(Dfa *d)
+{
+    free(d->set_off);
+    free(d->set_len);
+    free(d->flags);
+    free(d->trans);
+    free(d->hash);
+    free(d->mark);
+    free(d->stack);
+    free(d->tmp);
+    free(d->pool);
+}
+
+/* 把节点 id 的闭包加入 tmp，bol/eol 表示当前位置是否在行首/行尾 */
+static void dfa_closure(Dfa *d, int id, int bol, int eol)
+{
+    NfaNode *nodes = d->nfa->nodes;
+    int sp = 0;
+    d->stack[sp++] = id;
+    while (sp)
+    {
+        id = d->stack[--sp];
+        if (id < 0 || d->mark[id] == d->gen)
+            continue;
+        d->mark[id] = d->gen;
+        switch (nodes[id].type)
+        {
+        case NFA_SPLIT:
+            d->stack[sp++] = nodes[id].out1;
+            d->stack[sp++] = nodes[id].out;
+            break;
+        case NFA_BOL:
+            if (bol)
+                d->stack[sp++] = nodes[id].out;
+            break;
+        case NFA_EOL:
+            if (eol)
+                d->stack[sp++] = nodes[id].out;
+            else
+                d->tmp[d->tmp_n++] = id; // 留到行尾再判断
+            break;
+        default:
+            d->tmp[d->tmp_n++] = id;
+            break;
+        }
+    }
+}
+
+static int int_cmp(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+/* 查找或新建 tmp 对应的状态，状态用完时清空缓存，之前的状态编号全部失效 */
+static int dfa_state(Dfa *d)
+{
+    int n = d->tmp_n;
+    qsort(d->tmp, n, sizeof(int), int_cmp);
+
+    unsigned int h = 2166136261u;
+    for (int i = 0; i < n; i++)
+        h = (h ^ (unsigned int)d->tmp[i]) * 16777619u;
+
+    unsigned int slot = h & (DFA_HASH_SIZE - 1);
+    while (d->hash[slot] != -1)
+    {
+        int s = d->hash[slot];
+        if (d->set_len[s] == n && !memcmp(&d->pool[d->set_off[s]], d->tmp, sizeof(int) * n))
+            return s;
+        slot = (slot + 1) & (DFA_HASH_SIZE - 1);
+    }
+
+    if (d->num_states == DFA_MAX_STATES)
+    {
+        dfa_flush(d);
+        slot = h & (DFA_HASH_SIZE - 1);
+    }
+    if (d->pool_len + n > d->pool_cap)
+    {
+        d->pool_cap = (d->pool_len + n) * 2;
+        d->pool = realloc(d->pool, sizeof(int) * d->pool_cap);
+        if (d->pool == NULL)
+            die("realloc");
+    }
+
+    int s = d->num_states++;
+    d->set_off[s] = d->pool_len;
+    d->set_len[s] = n;
+    memcpy(&d->pool[d->pool_len], d->tmp, sizeof(int) * n);
+    d->pool_len += n;
+
+    d->flags[s] = 0;
+    for (int i = 0; i < n; i++)
+        if (d->nfa->nodes[d->tmp[i]].type == NFA_MATCH)
+            d->flags[s] = DFA_ACCEPT;
+    for (int c = 0; c < d->re->num_classes; c++)
+        d->trans[s * d->re->num_classes + c] = -1;
+
+    d->hash[slot] = s;
+    return s;
+}
+
+/* 起始状态，bol 表示是否在行首 */
+static int dfa_start(Dfa *d, int bol)
+{
+    if (d->start[bol] == -1)
+    {
+        d->gen++;
+        d->tmp_n = 0;
+        dfa_closure(d, d->nfa->start, bol, 0);
+        int s = dfa_state(d);
+        d->start[bol] = s;
+    }
+    return d->start[bol];
+}
+
+/* 计算状态 s 读入一类字节后的状态 */
+static int dfa_step(Dfa *d, int s, int cls)
+{
+    NfaNode *nodes = d->nfa->nodes;
+    int c = d->re->class_byte[cls];
+    int *set = &d->pool[d->set_off[s]];
+    int n = d->set_len[s];
+
+    d->gen++;
+    d->tmp_n = 0;
+    for (int i = 0; i < n; i++)
+        if (nodes[set[i]].type == NFA_CHAR && set_has(d->re->sets[nodes[set[i]].set], c))
+            dfa_closure(d, nodes[set[i]].out, 0, 0);
+    if (d->unanchored)
+        dfa_closure(d, d->nfa->start, 0, 0);
+
+    int flushes = d->flushes;
+    int next = dfa_state(d);
+    if (d->flushes != flushes) // 清空缓存后 s 已经无效
+        return next;
+    if (d->scan && ((d->flags[next] & DFA_ACCEPT) || cls == d->re->nl_class || cls == d->re->cr_class))
+        return next;
+    d->trans[s * d->re->num_classes + cls] = next * d->re->num_classes;
+    return next;
+}
+
+/* 当前位置是行尾时状态 s 是否匹配，bol 表示同时也在行首(空行) */
+static int dfa_eol_accept(Dfa *d, int s, int bol)
+{
+    int known = DFA_EOL_KNOWN << (bol * 2);
+    int accepted = DFA_EOL_ACCEPT << (bol * 2);
+    if (!(d->flags[s] & known))
+    {
+        NfaNode *nodes = d->nfa->nodes;
+        int *set = &d->pool[d->set_off[s]];
+        int n = d->set_len[s];
+        int accept = d->flags[s] & DFA_ACCEPT;
+
+        d->tmp_n = 0;
+        d->gen++;
+        for (int i = 0; i < n && !accept; i++)
+            if (nodes[set[i]].type == NFA_EOL)
+                dfa_closure(d, nodes[set[i]].out, bol, 1);
+        for (int i = 0; i < d->tmp_n; i++)
+            if (nodes[d->tmp[i]].type == NFA_MATCH)
+                accept = 1;
+        d->flags[s] |= known | (accept ? accepted : 0);
+    }
+    return d->flags[s] & accepted;
+}
+
+/* ---------- 接口 ---------- */
+
+Regexp *regexp_compile(const char *pattern)
+{
+    Regexp *re = calloc(1, sizeof(Regexp));
+    if (re == NULL)
+        die("calloc");
+
+    Parser p = {re, pattern, 0};
+    int root = parse_alt(&p);
+    if (p.error || *p.s != '\0')
+    {
+        regexp_free(re);
+        return NULL;
+    }
+
+    regexp_byte_classes(re);
+    regexp_prefix(re, root);
+    re->fwd.start = nfa_compile(re, &re->fwd, root, nfa_new(&re->fwd, NFA_MATCH, -1, -1, -1), 0);
+    re->rev.start = nfa_compile(re, &re->rev, root, nfa_new(&re->rev, NFA_MATCH, -1, -1, -1), 1);
+    if (re->fwd.overflow || re->rev.overflow)
+    {
+        regexp_free(re);
+        return NULL;
+    }
+
+    dfa_init(&re->search, re, &re->fwd, 1, 1);
+    dfa_init(&re->backward, re, &re->rev, 1, 0);
+    dfa_init(&re->anchored, re, &re->fwd, 0, 0);
+    return re;
+}
+
+void regexp_free(Regexp *re)
+{
+    if (re == NULL)
+        return;
+    if (re->search.nfa)
+    {
+        dfa_free(&re->search);
+        dfa_free(&re->backward);
+        dfa_free(&re->anchored);
+    }
+    free(re->fwd.nodes);
+    free(re->rev.nodes);
+    free(re->ast);
+    free(re->sets);
+    free(re);
+}
+
+/* pos 是否在行尾：文本末尾、换行符或者换行符前面的回车 */
+static int regexp_at_eol(const char *text, size_t n, size_t pos)
+{
+    return pos == n || text[pos] == '\n' || (text[pos] == '\r' && pos + 1 < n && text[pos + 1] == '\n');
+}
+
+/* 把 search 中的状态 s 换成 anchored 中节点集合相同的状态，之后只继续已经开始的匹配 */
+static int dfa_anchor(Regexp *re, int s)
+{
+    Dfa *from = &re->search;
+    Dfa *d = &re->anchored;
+    d->tmp_n = from->set_len[s];
+    memcpy(d->tmp, &from->pool[from->set_off[s]], sizeof(int) * d->tmp_n);
+    return dfa_state(d);
+}
+
+/*
+ * 用锚定的 DFA 从 pos 处的状态 s 向后走，到不可能再匹配或者行尾为止，返回最后一个匹配的结束位置，
+ * 没有匹配返回 -1。line 是当前行的开始位置，bol 表示它是否为真正的行首
+ */
+static ssize_t regexp_longest(Regexp *re, int s, const char *text, size_t n, size_t line, size_t pos, int bol)
+{
+    Dfa *d = &re->anchored;
+    ssize_t end = -1;
+    for (;; pos++)
+    {
+        if (d->flags[s] & DFA_ACCEPT)
+            end = pos;
+        if (regexp_at_eol(text, n, pos))
+        {
+            if (dfa_eol_accept(d, s, bol && pos == line))
+                end = pos;
+            break;
+        }
+        if (d->set_len[s] == 0)
+            break; // 不可能再匹配
+        int cls = re->byte_class[(unsigned char)text[pos]];
+        int next = d->trans[s * re->num_classes + cls];
+        s = next != -1 ? next / re->num_classes : dfa_step(d, s, cls);
+    }
+    return end;
+}
+
+/*
+ * 扫描在 pos 处第一次到达匹配状态 s 后，确定匹配的位置和长度。
+ * 从 pos 继续已经开始的匹配，得到它们最远的结束位置 end，最靠左的匹配一定在 end 之前结束；
+ * 再用反向 DFA 从 end 向前找最靠左的起点，最后从起点找最长的匹配。
+ * 每一步都只走到不可能再匹配为止，不会扫描到行尾，逐个查找一行中的匹配时总时间仍是线性的。
+ */
+static size_t regexp_match_at(Regexp *re, int s, const char *text, size_t n, size_t line, size_t pos, int bol,
+                              size_t *mlen)
+{
+    size_t end = regexp_longest(re, dfa_anchor(re, s), text, n, line, pos, bol);
+
+    Dfa *d = &re->backward;
+    int eol = regexp_at_eol(text, n, end);
+    size_t start = end;
+    s = dfa_start(d, eol);
+    for (size_t i = end;; i--)
+    {
+        if (d->flags[s] & DFA_ACCEPT)
+            start = i;
+        if (i == line)
+        {
+            if (bol && dfa_eol_accept(d, s, eol && end == line))
+                start = line;
+            break;
+        }
+        int cls = re->byte_class[(unsigned char)text[i - 1]];
+        int next = d->trans[s * re->num_classes + cls];
+        s = next != -1 ? next / re->num_classes : dfa_step(d, s, cls);
+    }
+
+    s = dfa_start(&re->anchored, bol && start == line);
+    *mlen = regexp_longest(re, s, text, n, line, start, bol) - start;
+    return start;
+}
+
+/* 从 from 开始在 text 的前 n 个字节中用 DFA 找第一个匹配，one_line 表示只找 from 所在的一行 */
+static ssize_t regexp_scan(Regexp *re, const char *text, size_t n, size_t from, int one_line, size_t *mlen)
+{
+    Dfa *d = &re->search;
+    const int *trans = d->trans;
+    const unsigned char *bc = re->byte_class;
+    int nc = re->num_classes;
+    size_t line = from; // 当前行的开始位置
+    int bol = from == 0 || text[from - 1] == '\n';
+    size_t i = from;
+    int s = dfa_start(d, bol);
+    int next;
+
+    for (;;)
+    {
+        if (d->flags[s] & DFA_ACCEPT)
+            break;
+
+        /* 已缓存的转移都不会到达匹配状态或行尾，直接查表 */
+        int row = s * nc;
+        while (i < n && (next = trans[row + bc[(unsigned char)text[i]]]) != -1)
+        {
+            row = next;
+            i++;
+        }
+        s = row / nc;
+
+        int cls = i < n ? bc[(unsigned char)text[i]] : re->nl_class;
+        if (cls == re->nl_class || (cls == re->cr_class && i + 1 < n && text[i + 1] == '\n'))
+        {
+            /* 行尾 */
+            if (dfa_eol_accept(d, s, bol && i == line))
+                break;
+            if (i == n || one_line)
+                return -1;
+            i += cls == re->nl_class ? 1 : 2;
+            line = i;
+            bol = 1;
+            s = dfa_start(d, 1);
+            continue;
+        }
+
+        s = dfa_step(d, s, cls);
+        i++;
+    }
+
+    size_t len;
+    size_t start = regexp_match_at(re, s, text, n, line, i, bol, &len);
+    if (mlen)
+        *mlen = len;
+    return start;
+}
+
+ssize_t regexp_search_from(Regexp *re, const char *text, size_t n, size_t from, size_t *mlen)
+{
+    if (re->prefix_len == 0)
+        return regexp_scan(re, text, n, from, 0, mlen);
+
+    /* 先找字面前缀，只在包含前缀的行中运行 DFA */
+    size_t pos = from;  // 下一个候选位置从这里开始找
+    size_t line = from; // 已经知道 [line, pos) 中没有换行符
+    while (pos + re->prefix_len <= n)
+    {
+        const char *p = memchr(&text[pos], re->prefix[0], n - pos - re->prefix_len + 1);
+        if (p == NULL)
+            return -1;
+        size_t at = p - text;
+        if (memcmp(p + 1, re->prefix + 1, re->prefix_len - 1))
+        {
+            pos = at + 1;
+            continue;
+        }
+
+        /* 向前找行首，最多回到 line */
+        size_t q = at;
+        while (q > line && text[q - 1] != '\n')
+            q--;
+        line = q;
+        /* 没有匹配时扫描已经走到了行尾，这时再找换行符也不会增加时间 */
+        ssize_t r = regexp_scan(re, text, n, line, 1, mlen);
+        if (r != -1)
+            return r;
+        const char *nl = memchr(p, '\n', n - at);
+        if (nl == NULL)
+            return -1;
+        pos = line = nl - text + 1;
+    }
+    return -1;
+}
+
+ssize_t regexp_search(Regexp *re, const char *text, size_t n, size_t *mlen)
+{
+    return regexp_search_from(re, text, n, 0, mlen);
+}
@@ -0,0 +1,237 @@
+#define _DEFAULT_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "./include/rowalloc.h"
+#include "./include/utils.h"
+
+#define ROWALLOC_ARENA_HEAD sizeof(size_t) // arena 中每次分配前记录的长度
+#define ROWALLOC_GRAIN 4096                // 页大小取整的单位
+
+/* 级别 cls 的块大小：2 的幂和它的 1.5 倍交替 */
+static size_t row_class_size(int cls)
+{
+    size_t base = (size_t)ROWALLOC_MIN << (cls / 2);
+    return cls % 2 ? base + base / 2 : base;
+}
+
+/* 能放下 size 字节的最小级别 */
+static int row_class(size_t size)
+{
+    int cls = 0;
+    while (row_class_size(cls) < size)
+        cls++;
+    return cls;
+}
+
+/* 所有页都按 ROWALLOC_PAGE 对齐，块所在的页头就在对齐的地址上 */
+static RowPage *row_page_of(void *p)
+{
+    return (RowPage *)((uintptr_t)p & ~(uintptr_t)(ROWALLOC_PAGE - 1));
+}
+
+/* 直接从系统映射对齐的页：多映射一页，再去掉前后多出的部分，释放时整页归还系统 */
+static RowPage *row_page_new(RowAlloc *ra, size_t size, int kind)
+{
+    size = (size + ROWALLOC_GRAIN - 1) & ~(size_t)(ROWALLOC_GRAIN - 1);
+    char *mem = mmap(NULL, size + ROWALLOC_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+        die("mmap");
+    size_t lead = (ROWALLOC_PAGE - (uintptr_t)mem % ROWALLOC_PAGE) % ROWALLOC_PAGE;
+    if (lead)
+        munmap(mem, lead);
+    munmap(mem + lead + size, ROWALLOC_PAGE - lead);
+
+    RowPage *pg = (RowPage *)(mem + lead);
+    pg->prev = NULL;
+    pg->next = ra->pages;
+    if (ra->pages)
+        ra->pages->prev = pg;
+    ra->pages = pg;
+    pg->size = size;
+    pg->used = 0;
+    pg->fill = 0;
+    pg->kind = kind;
+    pg->cls = 0;
+    ra->reserved += size;
+    ra->npages++;
+    return pg;
+}
+
+static void row_page_free(RowAlloc *ra, RowPage *pg)
+{
+    if (pg->prev)
+        pg->prev->next = pg->next;
+    else
+        ra->pages = pg->next;
+    if (pg->next)
+        pg->next->prev = pg->prev;
+    ra->reserved -= pg->size;
+    ra->npages--;
+    munmap(pg, pg->size);
+}
+
+void *row_alloc(RowAlloc *ra, size_t size)
+{
+    ra->allocs++;
+    if (size > ROWALLOC_MAX)
+    {
+        RowPage *pg = row_page_new(ra, ROWALLOC_HEAD + size, ROWPAGE_LARGE);
+        ra->large_bytes += pg->size;
+        return (char *)pg + ROWALLOC_HEAD;
+    }
+
+    int cls = row_class(size);
+    ra->live[cls]++;
+    void *p = ra->free_list[cls];
+    if (p)
+    {
+        ra->free_list[cls] = *(void **)p;
+        row_page_of(p)->used++;
+        return p;
+    }
+
+    /* 没有空闲块时从当前页切分，页用完再分配新页 */
+    size_t bs = row_class_size(cls);
+    if (ra->cur[cls] == NULL || ra->cur_off[cls] + bs > ROWALLOC_PAGE)
+    {
+        ra->cur[cls] = row_page_new(ra, ROWALLOC_PAGE, ROWPAGE_SLAB);
+        ra->cur[cls]->cls = cls;
+        ra->cur_off[cls] = ROWALLOC_HEAD;
+    }
+    p = (char *)ra->cur[cls] + ra->cur_off[cls];
+    ra->cur_off[cls] += bs;
+    ra->cur[cls]->used++;
+    return p;
+}
+
+size_t row_alloc_size(void *p)
+{
+    RowPage *pg = row_page_of(p);
+    if (pg->kind == ROWPAGE_SLAB)
+        return row_class_size(pg->cls);
+    if (pg->kind == ROWPAGE_ARENA)
+        return ((size_t *)p)[-1] - ROWALLOC_ARENA_HEAD;
+    return pg->size - ROWALLOC_HEAD;
+}
+
+void *row_realloc(RowAlloc *ra, void *p, size_t size)
+{
+    if (p == NULL)
+        return row_alloc(ra, size);
+
+    ra->reallocs++;
+    size_t cap = row_alloc_size(p);
+    if (size <= cap)
+    {
+        ra->in_place++;
+        return p;
+    }
+
+    /* 大块按 1.5 倍增长，逐字节追加时均摊 O(1) */
+    if (size > ROWALLOC_MAX && size < cap + cap / 2)
+        size = cap + cap / 2;
+    void *q = row_alloc(ra, size);
+    memcpy(q, p, cap);
+    row_free(ra, p);
+    return q;
+}
+
+void row_free(RowAlloc *ra, void *p)
+{
+    if (p == NULL)
+        return;
+
+    ra->frees++;
+    RowPage *pg = row_page_of(p);
+    if (pg->kind == ROWPAGE_SLAB)
+    {
+        /* 空闲块的开头存放链表指针 */
+        *(void **)p = ra->free_list[pg->cls];
+        ra->free_list[pg->cls] = p;
+        ra->live[pg->cls]--;
+        pg->used--;
+    }
+    else if (pg->kind == ROWPAGE_ARENA)
+    {
+        /* arena 只计数，整块都不再使用时才归还 */
+        size_t len = ((size_t *)p)[-1];
+        pg->used -= len;
+        ra->arena_live -= len;
+        if (pg->used == 0 && pg != ra->arena)
+        {
+            ra->arena_fill -= pg->fill;
+            row_page_free(ra, pg);
+        }
+    }
+    else
+    {
+        ra->large_bytes -= pg->size;
+        row_page_free(ra, pg);
+    }
+}
+
+void *row_arena_alloc(RowAlloc *ra, size_t size)
+{
+    size_t len = (ROWALLOC_ARENA_HEAD + size + sizeof(size_t) - 1) & ~(sizeof(size_t) - 1);
+    if (len > ROWALLOC_PAGE - ROWALLOC_HEAD)
+        return row_alloc(ra, size);
+
+    RowPage *pg = ra->arena;
+    if (pg == NULL || ROWALLOC_HEAD + pg->fill + len > ROWALLOC_PAGE)
+    {
+        if (pg && pg->used == 0)
+        {
+            ra->arena_fill -= pg->fill;
+            row_page_free(ra, pg);
+        }
+        pg = ra->arena = row_page_new(ra, ROWALLOC_PAGE, ROWPAGE_ARENA);
+    }
+
+    char *p = (char *)pg + ROWALLOC_HEAD + pg->fill;
+    *(size_t *)p = len;
+    pg->fill += len;
+    pg->used += len;
+    ra->arena_fill += len;
+    ra->arena_live += len;
+    ra->allocs++;
+    return p + ROWALLOC_ARENA_HEAD;
+}
+
+void row_alloc_reset(RowAlloc *ra)
+{
+    RowPage *pg = ra->pages;
+    while (pg)
+    {
+        RowPage *next = pg->next;
+        munmap(pg, pg->size);
+        pg = next;
+    }
+
+    /* 分配次数是累计值，保留 */
+    size_t allocs = ra->allocs, frees = ra->frees;
+    size_t reallocs = ra->reallocs, in_place = ra->in_place;
+    memset(ra, 0, sizeof(*ra));
+    ra->allocs = allocs;
+    ra->frees = frees;
+    ra->reallocs = reallocs;
+    ra->in_place = in_place;
+}
+
+int row_alloc_format(RowAlloc *ra, char *buf, size_t len)
+{
+    /* 碎片率：所有页中没有被使用的部分(级别取整、空闲块、未切分的部分和页头)所占的千分比 */
+    size_t used = ra->arena_live + ra->large_bytes;
+    for (int cls = 0; cls < ROWALLOC_CLASSES; cls++)
+        used += ra->live[cls] * row_class_size(cls);
+    size_t frag = ra->reserved ? (ra->reserved - used) * 1000 / ra->reserved : 0;
+    return snprintf(buf, len,
+                    "allocs=%zu frees=%zu reallocs=%zu in_place=%zu pages=%zu reserved=%zu used=%zu "
+                    "arena_live=%zu arena_dead=%zu large=%zu frag_permille=%zu",
+                    ra->allocs, ra->frees, ra->reallocs, ra->in_place, ra->npages, ra->reserved, used,
+                    ra->arena_live, ra->arena_fill - ra->arena_live, ra->large_bytes, frag);
+}
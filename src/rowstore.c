@@ -0,0 +1,345 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "./include/mvim.h"
+#include "./include/rowstore.h"
+#include "./include/utils.h"
+
+static RowNode *node_new(int leaf)
+{
+    RowNode *node = calloc(1, sizeof(RowNode));
+    if (node == NULL)
+        die("calloc");
+    node->leaf = leaf;
+    return node;
+}
+
+/* 设置 slot[i] 指向的行或子节点的所属节点 */
+static void node_adopt(RowNode *node, int i)
+{
+    if (node->leaf)
+        ((EditorRow *)node->slot[i])->node = node;
+    else
+        ((RowNode *)node->slot[i])->parent = node;
+}
+
+/* slot[i] 包含的行数 */
+static int slot_count(RowNode *node, int i)
+{
+    return node->leaf ? 1 : ((RowNode *)node->slot[i])->count;
+}
+
+static void node_recount(RowNode *node)
+{
+    int count = 0;
+    for (int i = 0; i < node->n; i++)
+        count += slot_count(node, i);
+    node->count = count;
+}
+
+static int slot_pos(RowNode *node, void *p)
+{
+    for (int i = 0; i < node->n; i++)
+        if (node->slot[i] == p)
+            return i;
+    return -1;
+}
+
+static void node_insert_slot(RowNode *node, int pos, void *p)
+{
+    memmove(&node->slot[pos + 1], &node->slot[pos], sizeof(void *) * (node->n - pos));
+    node->slot[pos] = p;
+    node->n++;
+    node_adopt(node, pos);
+}
+
+static void *node_remove_slot(RowNode *node, int pos)
+{
+    void *p = node->slot[pos];
+    memmove(&node->slot[pos], &node->slot[pos + 1], sizeof(void *) * (node->n - pos - 1));
+    node->n--;
+    return p;
+}
+
+/* 节点满时对半分裂，必要时向上传递直到根节点 */
+static void node_split(RowStore *rs, RowNode *node)
+{
+    while (node->n == ROWSTORE_FANOUT)
+    {
+        RowNode *right = node_new(node->leaf);
+        int half = node->n / 2;
+
+        right->n = node->n - half;
+        memcpy(right->slot, &node->slot[half], sizeof(void *) * right->n);
+        node->n = half;
+        for (int i = 0; i < right->n; i++)
+            node_adopt(right, i);
+        node_recount(node);
+        node_recount(right);
+
+        RowNode *parent = node->parent;
+        if (parent == NULL)
+        {
+            /* 根节点分裂，树高加一 */
+            parent = node_new(0);
+            parent->slot[0] = node;
+            parent->n = 1;
+            parent->count = node->count + right->count;
+            node->parent = parent;
+            rs->root = parent;
+        }
+        node_insert_slot(parent, slot_pos(parent, node) + 1, right);
+        node = parent;
+    }
+}
+
+/* 节点过空时与相邻兄弟合并或借用一个子节点 */
+static void node_rebalance(RowStore *rs, RowNode *node)
+{
+    while (node->parent && node->n < ROWSTORE_MIN_FILL)
+    {
+        RowNode *parent = node->parent;
+        int pos = slot_pos(parent, node);
+        int lpos = pos > 0 ? pos - 1 : pos;
+        RowNode *left = parent->slot[lpos];
+        RowNode *right = parent->slot[lpos + 1];
+
+        if (left->n + right->n < ROWSTORE_FANOUT)
+        {
+            /* 合并右节点到左节点 */
+            memcpy(&left->slot[left->n], right->slot, sizeof(void *) * right->n);
+            for (int i = left->n; i < left->n + right->n; i++)
+                node_adopt(left, i);
+            left->n += right->n;
+            left->count += right->count;
+            node_remove_slot(parent, lpos + 1);
+            free(right);
+            node = parent;
+        }
+        else
+        {
+            /* 从较满的兄弟节点借一个 */
+            if (left->n < right->n)
+            {
+                int c = slot_count(right, 0);
+                void *p = node_remove_slot(right, 0);
+                right->count -= c;
+                node_insert_slot(left, left->n, p);
+                left->count += c;
+            }
+            else
+            {
+                int c = slot_count(left, left->n - 1);
+                void *p = node_remove_slot(left, left->n - 1);
+                left->count -= c;
+                node_insert_slot(right, 0, p);
+                right->count += c;
+            }
+            break;
+        }
+    }
+
+    /* 根节点只剩一个子节点时降低树高 */
+    while (rs->root && !rs->root->leaf && rs->root->n == 1)
+    {
+        RowNode *child = rs->root->slot[0];
+        child->parent = NULL;
+        free(rs->root);
+        rs->root = child;
+    }
+    if (rs->root && rs->root->n == 0)
+    {
+        free(rs->root);
+        rs->root = NULL;
+    }
+}
+
+/* 从根节点向下找到第 *at 行所在叶子节点，*at 转换为叶子内偏移 */
+static RowNode *find_leaf(RowStore *rs, int *at)
+{
+    RowNode *node = rs->root;
+    while (!node->leaf)
+    {
+        int i;
+        for (i = 0; i < node->n - 1; i++)
+        {
+            int c = slot_count(node, i);
+            if (*at < c)
+                break;
+            *at -= c;
+        }
+        node = node->slot[i];
+    }
+    return node;
+}
+
+int rowstore_count(RowStore *rs)
+{
+    return rs->root ? rs->root->count : 0;
+}
+
+EditorRow *rowstore_get(RowStore *rs, int at)
+{
+    if (at < 0 || at >= rowstore_count(rs))
+        return NULL;
+    RowNode *leaf = find_leaf(rs, &at);
+    return leaf->slot[at];
+}
+
+void rowstore_insert(RowStore *rs, int at, EditorRow *row)
+{
+    if (at < 0 || at > rowstore_count(rs))
+        return;
+    if (rs->root == NULL)
+        rs->root = node_new(1);
+
+    RowNode *node = rs->root;
+    while (!node->leaf)
+    {
+        node->count++;
+        int i;
+        for (i = 0; i < node->n - 1; i++)
+        {
+            int c = slot_count(node, i);
+            if (at <= c) // 插入到子树末尾时优先放在左边
+                break;
+            at -= c;
+        }
+        node = node->slot[i];
+    }
+    node_insert_slot(node, at, row);
+    node->count++;
+
+    if (node->n == ROWSTORE_FANOUT)
+        node_split(rs, node);
+}
+
+EditorRow *rowstore_remove(RowStore *rs, int at)
+{
+    if (at < 0 || at >= rowstore_count(rs))
+        return NULL;
+
+    RowNode *node = rs->root;
+    while (!node->leaf)
+    {
+        node->count--;
+        int i;
+        for (i = 0; i < node->n - 1; i++)
+        {
+            int c = slot_count(node, i);
+            if (at < c)
+                break;
+            at -= c;
+        }
+        node = node->slot[i];
+    }
+    EditorRow *row = node_remove_slot(node, at);
+    node->count--;
+    row->node = NULL;
+
+    node_rebalance(rs, node);
+    return row;
+}
+
+int rowstore_index_of(EditorRow *row)
+{
+    RowNode *node = row->node;
+    if (node == NULL)
+        return -1;
+
+    int idx = slot_pos(node, row);
+    while (node->parent)
+    {
+        RowNode *parent = node->parent;
+        int pos = slot_pos(parent, node);
+        for (int i = 0; i < pos; i++)
+            idx += slot_count(parent, i);
+        node = parent;
+    }
+    return idx;
+}
+
+static void node_free(RowNode *node, void (*free_row)(EditorRow *))
+{
+    for (int i = 0; i < node->n; i++)
+    {
+        if (node->leaf)
+        {
+            if (free_row)
+                free_row(node->slot[i]);
+        }
+        else
+        {
+            node_free(node->slot[i], free_row);
+        }
+    }
+    free(node);
+}
+
+void rowstore_free(RowStore *rs, void (*free_row)(EditorRow *))
+{
+    if (rs->root)
+        node_free(rs->root, free_row);
+    rs->root = NULL;
+}
+
+EditorRow *rowstore_seek(RowStore *rs, int at, RowIter *it)
+{
+    if (at < 0 || at >= rowstore_count(rs))
+    {
+        it->leaf = NULL;
+        it->pos = 0;
+        return NULL;
+    }
+    it->leaf = find_leaf(rs, &at);
+    it->pos = at;
+    return it->leaf->slot[at];
+}
+
+/* 找到相邻的叶子节点，dir 为 1 表示右边，-1 表示左边 */
+static RowNode *leaf_sibling(RowNode *node, int dir)
+{
+    int pos = 0;
+    while (node->parent)
+    {
+        pos = slot_pos(node->parent, node) + dir;
+        node = node->parent;
+        if (pos >= 0 && pos < node->n)
+            break;
+    }
+    if (pos < 0 || pos >= node->n || node->leaf)
+        return NULL;
+
+    node = node->slot[pos];
+    while (!node->leaf)
+        node = node->slot[dir > 0 ? 0 : node->n - 1];
+    return node;
+}
+
+EditorRow *rowstore_next(RowIter *it)
+{
+    if (it->leaf == NULL)
+        return NULL;
+    if (++it->pos >= it->leaf->n)
+    {
+        it->leaf = leaf_sibling(it->leaf, 1);
+        it->pos = 0;
+        if (it->leaf == NULL)
+            return NULL;
+    }
+    return it->leaf->slot[it->pos];
+}
+
+EditorRow *rowstore_prev(RowIter *it)
+{
+    if (it->leaf == NULL)
+        return NULL;
+    if (--it->pos < 0)
+    {
+        it->leaf = leaf_sibling(it->leaf, -1);
+        if (it->leaf == NULL)
+            return NULL;
+        it->pos = it->leaf->n - 1;
+    }
+    return it->leaf->slot[it->pos];
+}
@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "./include/mvim.h"
+#include "./include/screen.h"
+#include "./include/utils.h"
+
+void screen_resize(Screen *scr, int rows, int cols)
+{
+    for (int y = 0; y < scr->rows; y++)
+        free(scr->lines[y].b);
+    free(scr->lines);
+
+    scr->lines = calloc(rows, sizeof(ScreenLine));
+    if (scr->lines == NULL && rows > 0)
+        die("calloc");
+    scr->rows = rows;
+    scr->cols = cols;
+    screen_invalidate(scr);
+}
+
+void screen_invalidate(Screen *scr)
+{
+    for (int y = 0; y < scr->rows; y++)
+        scr->lines[y].len = -1;
+}
+
+/* 判断 s 处的 SGR 序列是否把颜色恢复为默认 */
+static int screen_sgr_is_default(const char *s, int len)
+{
+    return (len == 3) || (len == 4 && s[2] == '0') || (len == 5 && s[2] == '3' && s[3] == '9');
+}
+
+/*
+ * 在新旧两行相同的开头部分中找最靠后的切分点，返回字节偏移，*col 为对应的屏幕列。
+ * 切分点不能在转义序列中间，此时颜色必须是默认值，并且之前只有单列宽的 ASCII 字符，
+ * 这样从切分点开始重新输出和整行输出的效果相同。
+ */
+static int screen_common_cut(const char *a, int alen, const char *b, int blen, int *col)
+{
+    int n = alen < blen ? alen : blen;
+    int i = 0, c = 0;
+    int cut = 0, cut_col = 0;
+    int is_default = 1;
+
+    while (i < n && a[i] == b[i])
+    {
+        unsigned char ch = b[i];
+        if (ch == '\x1b')
+        {
+            int j = i + 1;
+            if (j < blen && b[j] == '[')
+            {
+                j++;
+                while (j < blen && (b[j] < 0x40 || b[j] > 0x7e))
+                    j++;
+            }
+            j++; // 包含结束字符
+            if (j > n || memcmp(&a[i], &b[i], j - i))
+                break;
+            if (b[j - 1] == 'm')
+                is_default = screen_sgr_is_default(&b[i], j - i);
+            i = j;
+        }
+        else if (ch < 0x20 || ch >= 0x80)
+        {
+            break;
+        }
+        else
+        {
+            i++;
+            c++;
+        }
+
+        if (is_default)
+        {
+            cut = i;
+            cut_col = c;
+        }
+    }
+    *col = cut_col;
+    return cut;
+}
+
+void screen_put_line(Screen *scr, AppendBuffer *out, int y, const char *s, int len)
+{
+    if (y < 0 || y >= scr->rows)
+        return;
+
+    ScreenLine *line = &scr->lines[y];
+    if (line->len == len && (len == 0 || !memcmp(line->b, s, len)))
+        return; // 没有变化
+
+    /* 以清除行尾结束的行才能只输出变化的部分，否则旧内容可能残留 */
+    int col = 0, cut = 0;
+    if (line->len > 0 && len >= 3 && !memcmp(&s[len - 3], "\x1b[K", 3))
+    {
+        cut = screen_common_cut(line->b, line->len, s, len - 3, &col); // 结尾的清除行尾必须重新输出
+        if (col >= scr->cols)
+            cut = col = 0;
+    }
+
+    char buf[32];
+    int blen = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, col + 1);
+    ab_append(out, buf, blen);
+    ab_append(out, &s[cut], len - cut);
+
+    /* 更新影子缓冲 */
+    if (line->cap < len)
+    {
+        int cap = line->cap ? line->cap : 64;
+        while (cap < len)
+            cap *= 2;
+        char *b = realloc(line->b, cap);
+        if (b == NULL)
+            die("realloc");
+        line->b = b;
+        line->cap = cap;
+    }
+    if (len > 0)
+        memcpy(line->b, s, len);
+    line->len = len;
+}
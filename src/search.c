@@ -0,0 +1,118 @@
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "./include/regexp.h"
+#include "./include/search.h"
+
+void search_compile(SearchPattern *pat, const char *needle, size_t len)
+{
+    pat->needle = needle;
+    pat->len = len;
+    pat->re = NULL;
+
+    /* 不在模式串中的字节可以整体跳过 */
+    for (int c = 0; c < 256; c++)
+        pat->skip[c] = len;
+    if (len == 0)
+        return;
+
+    /* 跳跃距离：字节最后一次出现的位置到模式串末尾的距离 */
+    for (size_t i = 0; i < len - 1; i++)
+        pat->skip[(unsigned char)needle[i]] = len - 1 - i;
+}
+
+int search_compile_regex(SearchPattern *pat, const char *pattern)
+{
+    search_compile(pat, pattern, 0);
+    pat->re = regexp_compile(pattern);
+    return pat->re ? 0 : -1;
+}
+
+void search_free(SearchPattern *pat)
+{
+    regexp_free(pat->re);
+    pat->re = NULL;
+}
+
+/* Horspool 算法：从右向左比较，失配时按窗口最后一个字节跳跃 */
+static ssize_t search_horspool(const SearchPattern *pat, const char *text, size_t n)
+{
+    size_t m = pat->len;
+    const char *needle = pat->needle;
+    unsigned char last = needle[m - 1];
+
+    for (size_t i = 0; i + m <= n;)
+    {
+        unsigned char c = text[i + m - 1];
+        if (c == last && !memcmp(&text[i], needle, m - 1))
+            return i;
+        i += pat->skip[c];
+    }
+    return -1;
+}
+
+#ifdef __SSE2__
+/* 同时比较窗口的首尾字节，两者都相同的位置再比较中间部分 */
+static ssize_t search_sse2(const SearchPattern *pat, const char *text, size_t n)
+{
+    size_t m = pat->len;
+    const char *needle = pat->needle;
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[m - 1]);
+    size_t i = 0;
+
+    for (; i + m - 1 + 16 <= n; i += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)&text[i]);
+        __m128i b = _mm_loadu_si128((const __m128i *)&text[i + m - 1]);
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        while (mask)
+        {
+            int bit = __builtin_ctz(mask);
+            if (m <= 2 || !memcmp(&text[i + bit + 1], &needle[1], m - 2))
+                return i + bit;
+            mask &= mask - 1;
+        }
+    }
+
+    /* 剩余不足 16 个位置 */
+    ssize_t r = search_horspool(pat, &text[i], n - i);
+    return r == -1 ? -1 : (ssize_t)i + r;
+}
+#endif
+
+ssize_t search_forward(const SearchPattern *pat, const char *text, size_t n, size_t *mlen)
+{
+    if (pat->re)
+        return regexp_search(pat->re, text, n, mlen);
+
+    size_t m = pat->len;
+    if (mlen)
+        *mlen = m;
+    if (m == 0)
+        return 0;
+    if (m > n)
+        return -1;
+    if (m == 1)
+    {
+        const char *p = memchr(text, pat->needle[0], n);
+        return p ? p - text : -1;
+    }
+#ifdef __SSE2__
+    return search_sse2(pat, text, n);
+#else
+    return search_horspool(pat, text, n);
+#endif
+}
+
+ssize_t search_next(const SearchPattern *pat, const char *text, size_t n, size_t from, size_t *mlen)
+{
+    if (pat->re)
+        return regexp_search_from(pat->re, text, n, from, mlen);
+
+    ssize_t r = search_forward(pat, &text[from], n - from, mlen);
+    return r == -1 ? -1 : (ssize_t)from + r;
+}
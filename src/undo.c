@@ -0,0 +1,248 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "./include/undo.h"
+#include "./include/utils.h"
+
+#define UNDO_ALIGN(x) (((x) + sizeof(size_t) - 1) & ~(sizeof(size_t) - 1)) // 记录头按 size_t 对齐
+
+/* 在链表末尾分配一个至少能放下 need 字节的块 */
+static UndoChunk *undo_new_chunk(UndoLog *u, size_t need)
+{
+    size_t cap = need > UNDO_CHUNK_SIZE ? need : UNDO_CHUNK_SIZE;
+    UndoChunk *c = malloc(sizeof(UndoChunk) + cap);
+    if (c == NULL)
+        die("malloc");
+    c->prev = u->last;
+    c->next = NULL;
+    c->used = 0;
+    c->cap = cap;
+
+    if (u->last)
+        u->last->next = c;
+    else
+        u->first = c;
+    u->last = c;
+    u->bytes += cap;
+    return c;
+}
+
+static void undo_unlink_chunk(UndoLog *u, UndoChunk *c)
+{
+    if (c->prev)
+        c->prev->next = c->next;
+    else
+        u->first = c->next;
+    if (c->next)
+        c->next->prev = c->prev;
+    else
+        u->last = c->prev;
+    u->bytes -= c->cap;
+    free(c);
+}
+
+/* 丢弃可以重做的记录，它们位于内存池末尾，直接回退写入位置 */
+static void undo_truncate(UndoLog *u)
+{
+    if (u->cur == u->n)
+        return;
+
+    UndoEntry *e = &u->entries[u->cur];
+    e->chunk->used = (char *)e->rec - e->chunk->data;
+    while (u->last != e->chunk)
+        undo_unlink_chunk(u, u->last);
+    u->n = u->cur;
+}
+
+/* 超过内存上限时丢弃最旧的块和其中的记录，最后一块总是保留 */
+static void undo_trim(UndoLog *u)
+{
+    while (u->bytes > u->budget && u->first != u->last)
+    {
+        UndoChunk *c = u->first;
+        int k = 0;
+        while (k < u->n && u->entries[k].chunk == c)
+            k++;
+        memmove(u->entries, &u->entries[k], sizeof(UndoEntry) * (u->n - k));
+        u->n -= k;
+        u->cur -= k;
+        undo_unlink_chunk(u, c);
+    }
+}
+
+/* 追加一条空记录 */
+static UndoRecord *undo_new_record(UndoLog *u, int kind, int row, long col)
+{
+    undo_truncate(u);
+
+    UndoChunk *c = u->last;
+    size_t off = c ? UNDO_ALIGN(c->used) : 0;
+    if (c == NULL || off + sizeof(UndoRecord) > c->cap)
+    {
+        c = undo_new_chunk(u, sizeof(UndoRecord));
+        off = 0;
+    }
+    UndoRecord *rec = (UndoRecord *)&c->data[off];
+    c->used = off + sizeof(UndoRecord);
+
+    rec->kind = kind;
+    rec->row = rec->end_row = row;
+    rec->col = rec->end_col = col;
+    rec->reversed = 0;
+    rec->append_row = 0;
+    rec->len = 0;
+
+    if (u->n == u->cap)
+    {
+        u->cap = u->cap ? u->cap * 2 : 256;
+        u->entries = realloc(u->entries, sizeof(UndoEntry) * u->cap);
+        if (u->entries == NULL)
+            die("realloc");
+    }
+    u->entries[u->n].rec = rec;
+    u->entries[u->n].chunk = c;
+    u->n++;
+    u->cur = u->n;
+    u->open = 1;
+    return rec;
+}
+
+/* 最后一条记录的文本追加 n 个字节，所在块放不下时整条记录移到新块 */
+static UndoRecord *undo_append(UndoLog *u, const char *s, size_t n)
+{
+    UndoEntry *e = &u->entries[u->n - 1];
+    UndoChunk *c = e->chunk;
+    UndoRecord *rec = e->rec;
+    if (c->used + n > c->cap)
+    {
+        size_t size = sizeof(UndoRecord) + rec->len;
+        size_t off = (char *)rec - c->data;
+        UndoChunk *nc = undo_new_chunk(u, (size + n) * 2);
+        memcpy(nc->data, rec, size);
+        nc->used = size;
+        c->used = off;
+        if (off == 0)
+            undo_unlink_chunk(u, c);
+
+        rec = e->rec = (UndoRecord *)nc->data;
+        e->chunk = c = nc;
+    }
+    memcpy(&rec->text[rec->len], s, n);
+    rec->len += n;
+    c->used += n;
+    return rec;
+}
+
+void undo_insert(UndoLog *u, int row, long col, const char *s, size_t len, int append_row)
+{
+    if (u->applying)
+        return;
+
+    /* 紧接在上一次输入之后的插入合并到同一条记录 */
+    UndoRecord *rec = u->open ? u->entries[u->n - 1].rec : NULL;
+    if (rec == NULL || rec->kind != UNDO_INSERT || append_row || rec->end_row != row || rec->end_col != col)
+    {
+        rec = undo_new_record(u, UNDO_INSERT, row, col);
+        rec->append_row = append_row;
+    }
+    if (len > 0)
+        rec = undo_append(u, s, len);
+
+    /* 更新文本终点 */
+    const char *p = s;
+    const char *end = s + len;
+    const char *nl;
+    while ((nl = memchr(p, '\n', end - p)) != NULL)
+    {
+        rec->end_row++;
+        rec->end_col = 0;
+        p = nl + 1;
+    }
+    rec->end_col += end - p;
+
+    undo_trim(u);
+}
+
+void undo_delete(UndoLog *u, int row, long col, char c)
+{
+    if (u->applying)
+        return;
+
+    UndoRecord *rec = u->open ? u->entries[u->n - 1].rec : NULL;
+    if (rec && rec->kind == UNDO_DELETE)
+    {
+        /* 退格：删除的字符紧挨在记录起点之前，文本逆序追加 */
+        int next_row = c == '\n' ? row + 1 : row;
+        long next_col = c == '\n' ? 0 : col + 1;
+        if ((rec->reversed || rec->len == 1) && rec->row == next_row && rec->col == next_col)
+        {
+            rec = undo_append(u, &c, 1);
+            rec->reversed = 1;
+            rec->row = row;
+            rec->col = col;
+            undo_trim(u);
+            return;
+        }
+
+        /* 向后删除：起点不变 */
+        if (!rec->reversed && rec->row == row && rec->col == col)
+        {
+            undo_append(u, &c, 1);
+            undo_trim(u);
+            return;
+        }
+    }
+
+    undo_new_record(u, UNDO_DELETE, row, col);
+    undo_append(u, &c, 1);
+    undo_trim(u);
+}
+
+void undo_seal(UndoLog *u)
+{
+    u->open = 0;
+}
+
+UndoRecord *undo_step_back(UndoLog *u)
+{
+    u->open = 0;
+    if (u->cur == 0)
+        return NULL;
+    return u->entries[--u->cur].rec;
+}
+
+UndoRecord *undo_step_forward(UndoLog *u)
+{
+    u->open = 0;
+    if (u->cur == u->n)
+        return NULL;
+    return u->entries[u->cur++].rec;
+}
+
+char *undo_text(UndoRecord *rec)
+{
+    char *text = malloc(rec->len + 1);
+    if (text == NULL)
+        die("malloc");
+    if (rec->reversed)
+    {
+        for (size_t i = 0; i < rec->len; i++)
+            text[i] = rec->text[rec->len - 1 - i];
+    }
+    else
+    {
+        memcpy(text, rec->text, rec->len);
+    }
+    text[rec->len] = '\0';
+    return text;
+}
+
+void undo_free(UndoLog *u)
+{
+    while (u->first)
+        undo_unlink_chunk(u, u->first);
+    free(u->entries);
+    u->entries = NULL;
+    u->n = u->cap = u->cur = 0;
+    u->open = 0;
+}
@@ -0,0 +1,152 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "./include/utf8.h"
+#include "./include/utils.h"
+
+#define UTF8_BLOCK_SIZE (1 << UTF8_BLOCK_BITS)
+#define UTF8_BLOCKS ((UTF8_MAX_CODEPOINT + 1) >> UTF8_BLOCK_BITS)
+
+typedef struct Utf8Range
+{
+    int first, last;
+} Utf8Range;
+
+/* 占两列的东亚宽字符和全角字符 */
+static const Utf8Range utf8_wide[] = {
+    {0x1100, 0x115f},   {0x231a, 0x231b},   {0x2329, 0x232a},   {0x23e9, 0x23ec},   {0x23f0, 0x23f0},
+    {0x23f3, 0x23f3},   {0x25fd, 0x25fe},   {0x2614, 0x2615},   {0x2648, 0x2653},   {0x267f, 0x267f},
+    {0x2693, 0x2693},   {0x26a1, 0x26a1},   {0x26aa, 0x26ab},   {0x26bd, 0x26be},   {0x26c4, 0x26c5},
+    {0x26ce, 0x26ce},   {0x26d4, 0x26d4},   {0x26ea, 0x26ea},   {0x26f2, 0x26f3},   {0x26f5, 0x26f5},
+    {0x26fa, 0x26fa},   {0x26fd, 0x26fd},   {0x2705, 0x2705},   {0x270a, 0x270b},   {0x2728, 0x2728},
+    {0x274c, 0x274c},   {0x274e, 0x274e},   {0x2753, 0x2755},   {0x2757, 0x2757},   {0x2795, 0x2797},
+    {0x27b0, 0x27b0},   {0x27bf, 0x27bf},   {0x2b1b, 0x2b1c},   {0x2b50, 0x2b50},   {0x2b55, 0x2b55},
+    {0x2e80, 0x303e},   {0x3041, 0x33ff},   {0x3400, 0x4dbf},   {0x4e00, 0x9fff},   {0xa000, 0xa4cf},
+    {0xa960, 0xa97f},   {0xac00, 0xd7a3},   {0xf900, 0xfaff},   {0xfe10, 0xfe19},   {0xfe30, 0xfe6f},
+    {0xff00, 0xff60},   {0xffe0, 0xffe6},   {0x16fe0, 0x16fe4}, {0x17000, 0x18cff}, {0x1b000, 0x1b2ff},
+    {0x1f004, 0x1f004}, {0x1f0cf, 0x1f0cf}, {0x1f18e, 0x1f18e}, {0x1f191, 0x1f19a}, {0x1f200, 0x1f251},
+    {0x1f300, 0x1f64f}, {0x1f680, 0x1f6ff}, {0x1f900, 0x1f9ff}, {0x1fa70, 0x1faff}, {0x20000, 0x2fffd},
+    {0x30000, 0x3fffd},
+};
+
+/* 不占列的组合字符和零宽字符 */
+static const Utf8Range utf8_zero[] = {
+    {0x0300, 0x036f},   {0x0483, 0x0489}, {0x0591, 0x05bd}, {0x05bf, 0x05bf}, {0x05c1, 0x05c2},
+    {0x05c4, 0x05c5},   {0x05c7, 0x05c7}, {0x0610, 0x061a}, {0x064b, 0x065f}, {0x0670, 0x0670},
+    {0x06d6, 0x06dc},   {0x06df, 0x06e4}, {0x06e7, 0x06e8}, {0x06ea, 0x06ed}, {0x0900, 0x0902},
+    {0x093a, 0x093a},   {0x093c, 0x093c}, {0x0941, 0x0948}, {0x094d, 0x094d}, {0x0951, 0x0957},
+    {0x0e31, 0x0e31},   {0x0e34, 0x0e3a}, {0x0e47, 0x0e4e}, {0x1160, 0x11ff}, {0x1ab0, 0x1aff},
+    {0x1dc0, 0x1dff},   {0x200b, 0x200f}, {0x202a, 0x202e}, {0x2060, 0x2064}, {0x20d0, 0x20ff},
+    {0x302a, 0x302d},   {0x3099, 0x309a}, {0xfe00, 0xfe0f}, {0xfe20, 0xfe2f}, {0xfeff, 0xfeff},
+    {0xe0100, 0xe01ef},
+};
+
+static unsigned short *utf8_index;  // 每个块在 utf8_blocks 中的序号
+static unsigned char *utf8_blocks;  // 去重之后的块，每个码点一个字节的宽度
+
+int utf8_decode(const char *s, long len, int *cp)
+{
+    const unsigned char *u = (const unsigned char *)s;
+    if (u[0] < 0x80)
+    {
+        *cp = u[0];
+        return 1;
+    }
+
+    int n, min;
+    if (u[0] >= 0xc2 && u[0] <= 0xdf)
+    {
+        n = 2;
+        min = 0x80;
+        *cp = u[0] & 0x1f;
+    }
+    else if (u[0] >= 0xe0 && u[0] <= 0xef)
+    {
+        n = 3;
+        min = 0x800;
+        *cp = u[0] & 0x0f;
+    }
+    else if (u[0] >= 0xf0 && u[0] <= 0xf4)
+    {
+        n = 4;
+        min = 0x10000;
+        *cp = u[0] & 0x07;
+    }
+    else
+    {
+        *cp = -1;
+        return 1;
+    }
+
+    if (len < n)
+    {
+        *cp = -1;
+        return 1;
+    }
+    for (int i = 1; i < n; i++)
+    {
+        if ((u[i] & 0xc0) != 0x80)
+        {
+            *cp = -1;
+            return 1;
+        }
+        *cp = (*cp << 6) | (u[i] & 0x3f);
+    }
+
+    /* 过长编码、代理区和超出范围的码点都是无效的 */
+    if (*cp < min || (*cp >= 0xd800 && *cp <= 0xdfff) || *cp > UTF8_MAX_CODEPOINT)
+    {
+        *cp = -1;
+        return 1;
+    }
+    return n;
+}
+
+int utf8_width(int cp)
+{
+    if (cp < 0 || cp > UTF8_MAX_CODEPOINT)
+        return 1;
+    return utf8_blocks[(utf8_index[cp >> UTF8_BLOCK_BITS] << UTF8_BLOCK_BITS) | (cp & (UTF8_BLOCK_SIZE - 1))];
+}
+
+static void utf8_paint(unsigned char *width, const Utf8Range *ranges, size_t n, int w)
+{
+    for (size_t i = 0; i < n; i++)
+        memset(&width[ranges[i].first], w, ranges[i].last - ranges[i].first + 1);
+}
+
+void utf8_init()
+{
+    if (utf8_index)
+        return;
+
+    /* 先展开成每个码点一项，再把相同的块合并 */
+    unsigned char *width = malloc(UTF8_MAX_CODEPOINT + 1);
+    utf8_index = malloc(sizeof(unsigned short) * UTF8_BLOCKS);
+    if (width == NULL || utf8_index == NULL)
+        die("malloc");
+    memset(width, 1, UTF8_MAX_CODEPOINT + 1);
+    utf8_paint(width, utf8_wide, sizeof(utf8_wide) / sizeof(utf8_wide[0]), 2);
+    utf8_paint(width, utf8_zero, sizeof(utf8_zero) / sizeof(utf8_zero[0]), 0);
+
+    int unique = 0;
+    for (int b = 0; b < UTF8_BLOCKS; b++)
+    {
+        unsigned char *block = &width[b << UTF8_BLOCK_BITS];
+        int k;
+        for (k = 0; k < unique; k++)
+            if (!memcmp(&width[k << UTF8_BLOCK_BITS], block, UTF8_BLOCK_SIZE))
+                break;
+        if (k == unique)
+        {
+            /* 去重后的块依次移到数组前部 */
+            memmove(&width[k << UTF8_BLOCK_BITS], block, UTF8_BLOCK_SIZE);
+            unique++;
+        }
+        utf8_index[b] = k;
+    }
+
+    utf8_blocks = realloc(width, (size_t)unique << UTF8_BLOCK_BITS);
+    if (utf8_blocks == NULL)
+        die("realloc");
+}
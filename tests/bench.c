@@ -0,0 +1,348 @@
+/*
+ * 性能基准：生成 1 KB 到 1 GB 的文件，通过伪终端启动 mvim 并回放按键序列
+ * (输入、粘贴、搜索、滚动、保存)，每次按键都等到这一帧输出完(显示光标)为止。
+ * 每个文件和序列输出一行 key=value：按键延迟的 p50/p99/最大值(微秒)、
+ * 终端收到的字节数和 mvim 的内存峰值，便于比较不同版本。
+ * 用法: bench <mvim 路径> [临时目录] [最大文件大小(MB)]
+ */
+#define _GNU_SOURCE
+
+#include <poll.h>
+#include <pty.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TIMEOUT_MS 600000    // 每次按键最多等待的时间，打开和搜索 1 GB 的文件需要较长时间
+#define FRAME_END "\x1b[?25h" // 每一帧最后显示光标
+#define SAVED "bytes written to disk"
+#define MAX_KEYS 1024
+#define PASTE_SIZE 4096 // 每次粘贴的字节数
+
+typedef struct Key
+{
+    char *s;           // 一次按键发送的内容，粘贴时是整段 bracketed paste
+    const char *until; // 等待出现的内容
+} Key;
+
+static const char *mvim;
+static int master = -1;
+static pid_t child = -1;
+static Key keys[MAX_KEYS];
+static int num_keys;
+static double lat[MAX_KEYS];
+
+static void fail(const char *fmt, const char *arg)
+{
+    fprintf(stderr, "FAIL: ");
+    fprintf(stderr, fmt, arg);
+    fprintf(stderr, "\n");
+    if (child > 0)
+        kill(child, SIGKILL);
+    exit(1);
+}
+
+static double now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* 读取终端输出直到出现 s，返回读到的字节数 */
+static long long wait_for(const char *s)
+{
+    static char tail[64]; // 上一次读取的末尾，s 可能被分在两次读取中
+    static size_t tail_len;
+    size_t slen = strlen(s);
+    long long total = 0;
+    double deadline = now_us() + TIMEOUT_MS * 1e3;
+    char buf[65536 + sizeof(tail)];
+
+    tail_len = 0;
+    while (1)
+    {
+        int left = (int)((deadline - now_us()) / 1e3);
+        if (left <= 0)
+            fail("timed out waiting for \"%s\"", s);
+        struct pollfd pfd = {master, POLLIN, 0};
+        if (poll(&pfd, 1, left > 1000 ? 1000 : left) <= 0)
+            continue;
+
+        memcpy(buf, tail, tail_len);
+        ssize_t n = read(master, &buf[tail_len], 65536);
+        if (n <= 0)
+            fail("mvim exited while waiting for \"%s\"", s);
+        total += n;
+        size_t len = tail_len + n;
+        if (memmem(buf, len, s, slen))
+            return total;
+        tail_len = len < slen - 1 ? len : slen - 1;
+        memcpy(tail, &buf[len - tail_len], tail_len);
+    }
+}
+
+/* 读掉 ms 毫秒内的所有输出 */
+static void drain(int ms)
+{
+    char buf[65536];
+    double deadline = now_us() + ms * 1e3;
+    struct pollfd pfd = {master, POLLIN, 0};
+    while (now_us() < deadline)
+        if (poll(&pfd, 1, 10) > 0 && read(master, buf, sizeof(buf)) <= 0)
+            break;
+}
+
+static void add_key(const char *s, const char *until)
+{
+    if (num_keys == MAX_KEYS)
+        fail("%s", "too many keys");
+    keys[num_keys].s = strdup(s);
+    keys[num_keys].until = until;
+    num_keys++;
+}
+
+static void add_repeat(const char *s, int n)
+{
+    for (int i = 0; i < n; i++)
+        add_key(s, FRAME_END);
+}
+
+/* 各个按键序列 */
+static void trace_typing(void)
+{
+    const char *text = "int x = 42; /* typing */ return x;";
+    for (int line = 0; line < 8; line++)
+    {
+        for (const char *p = text; *p; p++)
+        {
+            char s[2] = {*p, '\0'};
+            add_key(s, FRAME_END);
+        }
+        add_repeat("\x7f", 4); // 退格
+        add_key("\r", FRAME_END);
+    }
+}
+
+static void trace_paste(void)
+{
+    static const char *line = "    buffer[i] = (char)(i * 31 + 7); /* pasted */\n";
+    for (int i = 0; i < 16; i++)
+    {
+        char s[PASTE_SIZE + 16] = "\x1b[200~";
+        size_t n = strlen(s);
+        while (n + strlen(line) + 6 < PASTE_SIZE)
+        {
+            memcpy(&s[n], line, strlen(line));
+            n += strlen(line);
+        }
+        memcpy(&s[n], "\x1b[201~", 7);
+        add_key(s, FRAME_END);
+    }
+}
+
+static void trace_search(void)
+{
+    /* 每输入一个字符都重新搜索整个文件 */
+    add_key("\x06", FRAME_END);
+    for (const char *p = "needle"; *p; p++)
+    {
+        char s[2] = {*p, '\0'};
+        add_key(s, FRAME_END);
+    }
+    add_key("\r", FRAME_END);
+    add_key("\x06", FRAME_END);
+    for (const char *p = "buffer"; *p; p++)
+    {
+        char s[2] = {*p, '\0'};
+        add_key(s, FRAME_END);
+    }
+    add_repeat("\x1b[B", 32); // 下一个匹配
+    add_key("\r", FRAME_END);
+    add_key("\x12", FRAME_END); // 正则表达式
+    for (const char *p = "ret.rn [a-z]+"; *p; p++)
+    {
+        char s[2] = {*p, '\0'};
+        add_key(s, FRAME_END);
+    }
+    add_key("\r", FRAME_END);
+}
+
+static void trace_scroll(void)
+{
+    add_repeat("\x1b[6~", 64); // PageDown
+    add_repeat("\x1b[B", 64);
+    add_repeat("\x1b[C", 64);
+    add_repeat("\x1b[5~", 64); // PageUp
+    add_repeat("\x1b[A", 64);
+}
+
+static void trace_save(void)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        add_key("s", FRAME_END);
+        add_key("\x13", SAVED);
+    }
+}
+
+static const struct
+{
+    const char *name;
+    void (*build)(void);
+} traces[] = {
+    {"typing", trace_typing},
+    {"paste", trace_paste},
+    {"search", trace_search},
+    {"scroll", trace_scroll},
+    {"save", trace_save}, // 会修改文件，放在最后
+};
+
+/* 生成 size 字节左右的类似源代码的文本，倒数第二行含有 "needle" */
+static void generate(const char *path, long long size)
+{
+    static const char *words[] = {"int", "return", "while", "char", "buffer", "x", "=", "42;", "{", "}", "/*", "*/",
+                                  "\"str\"", "1.5", "\tif"};
+    static char block[1 << 20];
+    size_t n = 0;
+    srand(1);
+    while (n + 128 < sizeof(block))
+    {
+        int col = 0;
+        while (col < 60)
+        {
+            const char *w = words[rand() % (sizeof(words) / sizeof(words[0]))];
+            size_t wl = strlen(w);
+            memcpy(&block[n], w, wl);
+            block[n + wl] = ' ';
+            n += wl + 1;
+            col += wl + 1;
+        }
+        block[n++] = '\n';
+    }
+
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL)
+        fail("open %s", path);
+    long long left = size > 64 ? size - 64 : 0;
+    while (left > 0)
+    {
+        /* 只写完整的行 */
+        size_t len = left < (long long)n ? (size_t)left : n;
+        while (len > 0 && block[len - 1] != '\n')
+            len--;
+        if (len == 0)
+            break;
+        if (fwrite(block, 1, len, fp) != len)
+            fail("write %s", path);
+        left -= len;
+    }
+    fputs("char *needle = \"found\";\n}\n", fp);
+    if (fclose(fp) != 0)
+        fail("write %s", path);
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* 打开文件回放一个序列，输出一行结果 */
+static void run(const char *path, long long size, const char *trace)
+{
+    /* 上一次运行留下的恢复日志会让 mvim 先询问是否恢复 */
+    char journal[4096];
+    const char *slash = strrchr(path, '/');
+    snprintf(journal, sizeof(journal), "%.*s.%s.mswp", (int)(slash ? slash - path + 1 : 0), path,
+             slash ? slash + 1 : path);
+    unlink(journal);
+
+    struct winsize ws = {24, 80, 0, 0};
+    double t0 = now_us();
+    child = forkpty(&master, NULL, NULL, &ws);
+    if (child == -1)
+        fail("%s", "forkpty");
+    if (child == 0)
+    {
+        execl(mvim, mvim, path, (char *)NULL);
+        _exit(127);
+    }
+    wait_for(FRAME_END);
+    double open_ms = (now_us() - t0) / 1e3;
+    drain(200); // 启动时的状态栏信息之后可能还有一帧
+
+    long long tty_bytes = 0;
+    for (int i = 0; i < num_keys; i++)
+    {
+        size_t len = strlen(keys[i].s);
+        double t = now_us();
+        if (write(master, keys[i].s, len) != (ssize_t)len)
+            fail("%s", "write");
+        tty_bytes += wait_for(keys[i].until);
+        lat[i] = now_us() - t;
+    }
+
+    /* 有未保存的修改时需要多按几次 */
+    for (int i = 0; i < 4; i++)
+        if (write(master, "\x11", 1) != 1)
+            break;
+    int status;
+    struct rusage ru;
+    memset(&ru, 0, sizeof(ru));
+    double deadline = now_us() + 10e6;
+    while (wait4(child, &status, WNOHANG, &ru) == 0)
+    {
+        char buf[4096];
+        struct pollfd pfd = {master, POLLIN, 0};
+        if (poll(&pfd, 1, 100) > 0 && read(master, buf, sizeof(buf)) <= 0)
+            usleep(10000);
+        if (now_us() > deadline)
+            kill(child, SIGKILL);
+    }
+    child = -1;
+    close(master);
+    unlink(journal);
+
+    qsort(lat, num_keys, sizeof(double), cmp_double);
+    printf("size=%lld trace=%s keys=%d open_ms=%.1f p50_us=%.0f p99_us=%.0f max_us=%.0f tty_bytes=%lld "
+           "peak_rss_kb=%ld\n",
+           size, trace, num_keys, open_ms, lat[num_keys / 2], lat[num_keys * 99 / 100], lat[num_keys - 1], tty_bytes,
+           ru.ru_maxrss);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s mvim [dir] [max MB]\n", argv[0]);
+        return 2;
+    }
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    mvim = argv[1];
+    const char *dir = argc > 2 ? argv[2] : ".";
+    long long max = (argc > 3 ? strtoll(argv[3], NULL, 10) : 1024) << 20;
+
+    /* 1 KB 到 max，每次乘以 32 */
+    for (long long size = 1024; size <= max; size *= 32)
+    {
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/bench_%lld.c", dir, size);
+        generate(path, size);
+        for (size_t t = 0; t < sizeof(traces) / sizeof(traces[0]); t++)
+        {
+            traces[t].build();
+            run(path, size, traces[t].name);
+            while (num_keys > 0)
+                free(keys[--num_keys].s);
+        }
+        unlink(path);
+    }
+    return 0;
+}
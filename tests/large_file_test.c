@@ -0,0 +1,201 @@
+/*
+ * 大文件测试：生成一个超过 4 GB 的稀疏文件，其中一行本身就超过 4 GB，
+ * 通过伪终端驱动 mvim 检查行数、搜索、光标位置和保存后的文件大小。
+ * 用法: large_file_test <mvim 路径> [临时目录] [长行大小(MB)]
+ */
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pty.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SHORT_ROWS 60       // 长行前后各有的短行数
+#define TIMEOUT_MS 600000   // 每一步最多等待的时间，保存几个 GB 需要较长时间
+
+static int master = -1;
+static pid_t child = -1;
+static char *out;       // 上一次重绘之后终端收到的内容
+static size_t out_len, out_cap;
+static int resize_toggle;
+
+static void fail(const char *fmt, const char *arg)
+{
+    fprintf(stderr, "FAIL: ");
+    fprintf(stderr, fmt, arg);
+    fprintf(stderr, "\n");
+    if (child > 0)
+        kill(child, SIGKILL);
+    exit(1);
+}
+
+static long long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* 读取终端输出直到出现 s */
+static void expect(const char *s)
+{
+    long long deadline = now_ms() + TIMEOUT_MS;
+    while (1)
+    {
+        if (out_len > 0)
+        {
+            out[out_len] = '\0';
+            if (strstr(out, s))
+                return;
+        }
+
+        long long left = deadline - now_ms();
+        if (left <= 0)
+            fail("timed out waiting for \"%s\"", s);
+        struct pollfd pfd = {master, POLLIN, 0};
+        if (poll(&pfd, 1, left > 1000 ? 1000 : (int)left) <= 0)
+            continue;
+
+        if (out_len + 4096 + 1 > out_cap)
+        {
+            out_cap = out_cap ? out_cap * 2 : 65536;
+            out = realloc(out, out_cap);
+            if (out == NULL)
+                fail("%s", "realloc");
+        }
+        ssize_t n = read(master, &out[out_len], 4096);
+        if (n <= 0)
+            fail("mvim exited while waiting for \"%s\"", s);
+        out_len += n;
+    }
+}
+
+/* 改变终端大小让 mvim 重绘整个屏幕，之后的输出包含完整的状态栏 */
+static void repaint(void)
+{
+    struct winsize ws = {24 + (resize_toggle ^= 1), 100, 0, 0};
+    out_len = 0;
+    ioctl(master, TIOCSWINSZ, &ws);
+    kill(child, SIGWINCH);
+}
+
+static void send_keys(const char *s)
+{
+    size_t len = strlen(s);
+    if (write(master, s, len) != (ssize_t)len)
+        fail("%s", "write");
+    usleep(100000);
+}
+
+static void write_at(int fd, const char *s, off_t off)
+{
+    if (pwrite(fd, s, strlen(s), off) != (ssize_t)strlen(s))
+        fail("%s", "pwrite");
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s mvim [dir] [long line MB]\n", argv[0]);
+        return 2;
+    }
+    setvbuf(stdout, NULL, _IOLBF, 0); // 超时被终止时也能看到已经通过的步骤
+    const char *dir = argc > 2 ? argv[2] : ".";
+    long long big = (argc > 3 ? strtoll(argv[3], NULL, 10) : 4608) << 20;
+
+    /* 前后各 SHORT_ROWS 个短行，中间一行大部分是空洞，最后一行是 "LAST" */
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/large_file_test.txt", dir);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+        fail("open %s", path);
+
+    char line[64];
+    off_t off = 0;
+    for (int i = 0; i < SHORT_ROWS; i++)
+    {
+        snprintf(line, sizeof(line), "line %d\n", i);
+        write_at(fd, line, off);
+        off += strlen(line);
+    }
+    off_t big_start = off;
+    write_at(fd, "BEGIN", off);
+    off_t big_end = big_start + big; // "END\n" 的位置
+    write_at(fd, "END\n", big_end - 3);
+    off = big_end + 1;
+    for (int i = 0; i < SHORT_ROWS; i++)
+    {
+        snprintf(line, sizeof(line), "line %d\n", i);
+        write_at(fd, line, off);
+        off += strlen(line);
+    }
+    write_at(fd, "LAST\n", off);
+    off += 5;
+    close(fd);
+
+    int num_rows = SHORT_ROWS * 2 + 2;
+    long long size = off;
+    printf("%s: %lld bytes, long line %lld bytes, %d lines\n", path, size, big, num_rows);
+
+    /* 在伪终端中启动 mvim */
+    struct winsize ws = {24, 100, 0, 0};
+    child = forkpty(&master, NULL, NULL, &ws);
+    if (child == -1)
+        fail("%s", "forkpty");
+    if (child == 0)
+    {
+        execl(argv[1], argv[1], path, (char *)NULL);
+        _exit(127);
+    }
+
+    char buf[128];
+    snprintf(buf, sizeof(buf), " - %d lines", num_rows);
+    expect(buf);
+    printf("ok: line count\n");
+
+    /* 搜索最后一行：匹配要跨过长行才能对应到正确的行号 */
+    send_keys("\x06LAST");
+    repaint();
+    snprintf(buf, sizeof(buf), "match 1/1 | no ft | %d/%d", num_rows, num_rows);
+    expect(buf);
+    send_keys("\r");
+    printf("ok: search across the long line\n");
+
+    /* 修改后保存，写入的字节数超过 4 GB */
+    send_keys("X\x13");
+    snprintf(buf, sizeof(buf), "%lld bytes written to disk", size + 1);
+    expect(buf);
+    printf("ok: save\n");
+
+    send_keys("\x11");
+    int status;
+    waitpid(child, &status, 0);
+    child = -1;
+
+    /* 检查保存后的文件：大小、长行末尾和修改的位置 */
+    struct stat st;
+    if (stat(path, &st) == -1 || st.st_size != size + 1)
+        fail("%s has the wrong size after save", path);
+    fd = open(path, O_RDONLY);
+    char got[8] = {0};
+    if (pread(fd, got, 5, big_start) != 5 || memcmp(got, "BEGIN", 5))
+        fail("%s", "long line start changed");
+    if (pread(fd, got, 4, big_end - 3) != 4 || memcmp(got, "END\n", 4))
+        fail("%s", "long line end changed");
+    if (pread(fd, got, 6, size - 5) != 6 || memcmp(got, "XLAST\n", 6))
+        fail("%s", "edit was not saved");
+    close(fd);
+    unlink(path);
+    printf("ok: saved file\n");
+    return 0;
+}
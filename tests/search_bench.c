@@ -0,0 +1,178 @@
+/*
+ * 搜索基准测试：比较原来逐行调用 strstr 和搜索引擎扫描连续内存的速度，
+ * 并检查在很长的一行中逐个查找正则表达式的匹配时总时间是线性的。
+ * 用法: search_bench [文件大小(MB)]
+ */
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "search.h"
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t mb = argc > 1 ? strtoul(argv[1], NULL, 10) : 64;
+    size_t len = mb << 20;
+    static const char *words[] = {"int", "return", "while", "char", "buffer", "x", "=", "42;", "{", "}", "/*", "*/"};
+
+    /* 生成类似源代码的文本，每行以换行结束 */
+    char *text = malloc(len + 1);
+    size_t num_rows = 0;
+    size_t n = 0;
+    srand(1);
+    while (n + 80 < len)
+    {
+        int col = 0;
+        while (col < 60)
+        {
+            const char *w = words[rand() % (sizeof(words) / sizeof(words[0]))];
+            int wl = strlen(w);
+            memcpy(&text[n], w, wl);
+            text[n + wl] = ' ';
+            n += wl + 1;
+            col += wl + 1;
+        }
+        text[n++] = '\n';
+        num_rows++;
+    }
+    text[n] = '\0';
+
+    /* 原来的做法：每行单独一个以 '\0' 结尾的字符串 */
+    char **rows = malloc(sizeof(char *) * num_rows);
+    char *p = text;
+    for (size_t i = 0; i < num_rows; i++)
+    {
+        char *nl = strchr(p, '\n');
+        rows[i] = strndup(p, nl - p);
+        p = nl + 1;
+    }
+
+    static const char *queries[] = {"not_present", "buffer x", "z", "return while char"};
+    printf("%zu MB, %zu rows\n", mb, num_rows);
+    printf("%-20s %12s %12s %12s %8s\n", "query", "matches", "strstr(ms)", "engine(ms)", "speedup");
+    for (size_t q = 0; q < sizeof(queries) / sizeof(queries[0]); q++)
+    {
+        const char *query = queries[q];
+        size_t qlen = strlen(query);
+
+        /* 每行找第一个匹配，和 editor_find_callback 原来的循环相同 */
+        double t0 = now_ms();
+        size_t hits_old = 0;
+        for (size_t i = 0; i < num_rows; i++)
+            if (strstr(rows[i], query))
+                hits_old++;
+        double t_old = now_ms() - t0;
+
+        /* 搜索引擎：在连续文本中查找，每行只计一次 */
+        SearchPattern pat;
+        search_compile(&pat, query, qlen);
+        t0 = now_ms();
+        size_t hits_new = 0;
+        size_t off = 0;
+        while (off < n)
+        {
+            ssize_t r = search_forward(&pat, &text[off], n - off, NULL);
+            if (r == -1)
+                break;
+            hits_new++;
+            char *nl = memchr(&text[off + r], '\n', n - off - r);
+            off = nl ? (size_t)(nl - text) + 1 : n;
+        }
+        double t_new = now_ms() - t0;
+
+        if (hits_old != hits_new)
+        {
+            fprintf(stderr, "mismatch for \"%s\": %zu vs %zu\n", query, hits_old, hits_new);
+            return 1;
+        }
+        printf("%-20s %12zu %12.2f %12.2f %7.1fx\n", query, hits_new, t_old, t_new, t_old / t_new);
+    }
+
+    /* 正则表达式：只有搜索引擎的时间 */
+    static const char *patterns[] = {"buffer x", "r[a-z]+n w", "[0-9]{2};$", "x = [0-9]+; \\{"};
+    printf("\n%-20s %12s %12s %12s\n", "regex", "matches", "engine(ms)", "MB/s");
+    for (size_t q = 0; q < sizeof(patterns) / sizeof(patterns[0]); q++)
+    {
+        SearchPattern pat;
+        if (search_compile_regex(&pat, patterns[q]) == -1)
+            return 1;
+        double t0 = now_ms();
+        size_t hits = 0;
+        size_t off = 0;
+        while (off < n)
+        {
+            ssize_t r = search_forward(&pat, &text[off], n - off, NULL);
+            if (r == -1)
+                break;
+            hits++;
+            char *nl = memchr(&text[off + r], '\n', n - off - r);
+            off = nl ? (size_t)(nl - text) + 1 : n;
+        }
+        double t = now_ms() - t0;
+        printf("%-20s %12zu %12.2f %12.0f\n", patterns[q], hits, t, mb / (t / 1000));
+        search_free(&pat);
+    }
+
+    /*
+     * 一行很长且包含很多匹配时逐个查找所有匹配，每个匹配只应扫描它附近的内容，
+     * 总时间和行的长度成线性关系。行长 8 倍时时间超过 24 倍说明退化成了平方
+     */
+    static const char *line_patterns[] = {"1", "a1|[0-9]+", "a*1"};
+    printf("\n%-20s %12s %12s %12s\n", "long line regex", "matches", "1 MB(ms)", "8 MB(ms)");
+    for (size_t q = 0; q < sizeof(line_patterns) / sizeof(line_patterns[0]); q++)
+    {
+        SearchPattern pat;
+        if (search_compile_regex(&pat, line_patterns[q]) == -1)
+            return 1;
+        double t[2];
+        size_t hits = 0;
+        for (int k = 0; k < 2; k++)
+        {
+            size_t line_len = (size_t)1 << (k ? 23 : 20);
+            if (line_len > len)
+                line_len = len;
+            for (size_t i = 0; i < line_len; i++)
+                text[i] = i % 10 == 9 ? '1' : 'a';
+
+            double t0 = now_ms();
+            hits = 0;
+            size_t from = 0;
+            size_t mlen;
+            ssize_t r;
+            while (from <= line_len && (r = search_next(&pat, text, line_len, from, &mlen)) != -1)
+            {
+                hits++;
+                from = r + (mlen ? mlen : 1);
+            }
+            t[k] = now_ms() - t0;
+            if (hits != line_len / 10)
+            {
+                fprintf(stderr, "wrong match count for \"%s\": %zu\n", line_patterns[q], hits);
+                return 1;
+            }
+        }
+        printf("%-20s %12zu %12.2f %12.2f\n", line_patterns[q], hits, t[0], t[1]);
+        search_free(&pat);
+        if (t[1] > t[0] * 24 + 10)
+        {
+            fprintf(stderr, "long line regex \"%s\" is not linear\n", line_patterns[q]);
+            return 1;
+        }
+    }
+
+    for (size_t i = 0; i < num_rows; i++)
+        free(rows[i]);
+    free(rows);
+    free(text);
+    return 0;
+}